@@ -11,9 +11,16 @@ LOCAL_SRC_FILES := \
 	src/filters/repeat.c \
 	src/filters/stat.c \
 	src/filters/tcp.c \
+	src/filters/x264.c \
+	src/alloc.c \
 	src/cap.cpp \
+	src/encoder.c \
 	src/filter.c \
+	src/loop.c \
+	src/roi.c \
+	src/thread_policy.c \
 	src/utils.c \
+	src/workers.cpp \
 	src/arpcap.c \
 
 LOCAL_C_INCLUDES := \
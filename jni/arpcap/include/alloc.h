@@ -0,0 +1,46 @@
+/*
+ * Copyright 2018 ARP Network
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ARP_ALLOC_H_
+#define ARP_ALLOC_H_
+
+#include <libavutil/buffer.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Alignment of the frame buffers and of their rows, a cache line.
+#define FRAME_ALIGN 64
+
+/*
+ * Backs the frame buffers allocated from now on with huge pages: explicit
+ * ones when the system has some reserved, transparent ones otherwise. Meant
+ * to be called once, before any capture starts.
+ */
+void frame_alloc_use_hugepages(int enable);
+
+/*
+ * A new FRAME_ALIGN aligned buffer of size bytes, with the signature of an
+ * AVBufferPool allocator.
+ */
+AVBufferRef *frame_buffer_alloc(int size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // ARP_ALLOC_H_
@@ -25,8 +25,34 @@ extern "C" {
 
 typedef struct Cap Cap;
 
-Cap *cap_open(int top, int bottom, int width, int height, int framerate);
+typedef struct CapParam {
+  int display;
+  int top;
+  int bottom;
+  int width;
+  int height;
+  int framerate;
+  int min_framerate;  // adapt the rate to motion between this and framerate
+  int latest_frame;
+  int convert_threads;
+  int pixel_format;   // PIXEL_FORMAT_* requested from the display, 0 for default
+  int nv12;           // output NV12 instead of I420
+  int crop_x;         // region to capture, the whole frame if empty
+  int crop_y;
+  int crop_width;
+  int crop_height;
+  int damage_tiles;   // only convert tiles that changed since the last frame
+} CapParam;
+
+// Returns the PIXEL_FORMAT_* named rgba, bgra or rgb565, or -1.
+int cap_pixel_format(const char *name);
+
+Cap *cap_open(const CapParam *param);
+// Readable when a frame is ready to be read.
+int cap_get_fd(Cap *cap);
 int cap_read(Cap *cap, AVPacket *pkt);
+// Current capture rate, below the requested one when adapting to motion.
+double cap_get_framerate(Cap *cap);
 int cap_close(Cap *cap);
 
 #ifdef __cplusplus
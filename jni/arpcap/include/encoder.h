@@ -0,0 +1,67 @@
+/*
+ * Copyright 2018 ARP Network
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ARP_ENCODER_H_
+#define ARP_ENCODER_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ENCODER_THREADS_AUTO -1
+
+enum ThreadType
+{
+  THREAD_TYPE_DEFAULT = 0,
+  // Several frames in flight, more throughput at the cost of a frame of
+  // latency per thread.
+  THREAD_TYPE_FRAME,
+  // Each frame split in slices, no added latency.
+  THREAD_TYPE_SLICE,
+};
+
+/*
+ * Threading of the H.264 encoders. The defaults leave the encoder as
+ * libavcodec sets it up: x264 picks the thread count and the zerolatency
+ * tune sliced threads.
+ */
+typedef struct EncoderThreads {
+  // Thread count, 0 for x264's default (X264_THREADS_AUTO),
+  // ENCODER_THREADS_AUTO to choose the count and type from the CPUs and
+  // the picture size.
+  int threads;
+  // THREAD_TYPE_DEFAULT keeps the type of the tune.
+  enum ThreadType type;
+  // Frames of rate control and of thread lookahead, -1 for the preset's.
+  int lookahead;
+  int sync_lookahead;
+} EncoderThreads;
+
+/*
+ * The threading to encode width x height pictures with, on the CPUs of the
+ * cpus mask, or on the CPUs the calling thread may run on when 0. Resolves
+ * ENCODER_THREADS_AUTO, other settings are returned as they are.
+ */
+void encoder_threads_resolve(const EncoderThreads *threads, uint64_t cpus,
+                             int width, int height, EncoderThreads *resolved);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // ARP_ENCODER_H_
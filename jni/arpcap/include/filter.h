@@ -40,6 +40,9 @@ typedef struct Filter {
   int (*init)(TranscodeContext *ctx, int type);
   int (*fini)(TranscodeContext *ctx);
   int (*apply)(TranscodeContext *ctx, AVPacket *pkt);
+  // Optional, called on shutdown until it fails to hand out the packets the
+  // filter still holds, which go through the filters after it.
+  int (*flush)(TranscodeContext *ctx, AVPacket *pkt);
 } Filter;
 
 void filter_register_all();
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2018 ARP Network
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ARP_LOOP_H_
+#define ARP_LOOP_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Event loop waking the filter thread when one of its registered eventfds or
+ * timerfds becomes readable.
+ */
+typedef struct EventLoop EventLoop;
+
+EventLoop *loop_create();
+void loop_destroy(EventLoop *loop);
+
+int loop_add(EventLoop *loop, int fd);
+void loop_remove(EventLoop *loop, int fd);
+
+/*
+ * Blocks until a registered fd is readable or timeout (ms, -1 for none)
+ * expires, and drains every readable fd. Returns the number of fds drained.
+ */
+int loop_wait(EventLoop *loop, int timeout);
+
+/*
+ * Makes loop_wait return. Async-signal-safe.
+ */
+void loop_wakeup(EventLoop *loop);
+
+int loop_timer_create();
+int loop_timer_set(int fd, int64_t us, int periodic);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // ARP_LOOP_H_
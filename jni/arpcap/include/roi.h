@@ -0,0 +1,45 @@
+/*
+ * Copyright 2018 ARP Network
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ARP_ROI_H_
+#define ARP_ROI_H_
+
+#include <utils.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Fills offsets, one per 16x16 macroblock of a width x height picture, with
+ * the QP offset of each macroblock: 0 where the picture changed and
+ * static_offset elsewhere. A NULL damage means nothing changed.
+ */
+void roi_quant_offsets(float *offsets, int width, int height,
+                       const PktDamage *damage, float static_offset);
+
+/*
+ * The quant offsets of the picture in pkt, from its PktDamage, allocated
+ * with av_malloc() so that x264 can free them once it has encoded the
+ * picture. NULL when the changes are unknown.
+ */
+float *roi_packet_quant_offsets(const AVPacket *pkt, float static_offset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // ARP_ROI_H_
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2018 ARP Network
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ARP_THREAD_POLICY_H_
+#define ARP_THREAD_POLICY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Where and how a thread runs. The default policy, all zero, leaves the
+ * thread as it is.
+ */
+typedef struct ThreadPolicy {
+  // Mask of the CPUs the thread may run on, 0 for the CPUs the process
+  // started on.
+  uint64_t cpus;
+  // SCHED_FIFO priority, 0 for the normal time sharing policy.
+  int fifo_priority;
+  // Nice level, applied only when set_nice is non-zero.
+  int nice;
+  int set_nice;
+} ThreadPolicy;
+
+/*
+ * Parses a CPU list such as "4-7" or "0,2,4-5" into a mask of CPUs 0 to 63,
+ * returns -1 when the list is malformed.
+ */
+int thread_parse_cpus(const char *list, uint64_t *cpus);
+
+int thread_policy_isset(const ThreadPolicy *policy);
+
+/*
+ * Applies policy to the calling thread. Threads it creates afterwards
+ * inherit the policy, and its name. Failures are logged and ignored.
+ */
+void thread_apply_policy(const ThreadPolicy *policy);
+
+/*
+ * Saved state of a thread switched to another name and policy, for the
+ * threads that a library such as x264 starts to inherit them.
+ */
+typedef struct ThreadSwitch {
+  char name[16];
+  const ThreadPolicy *restore;
+  int placed;
+} ThreadSwitch;
+
+/*
+ * Gives the calling thread name and policy until thread_switch_back(), which
+ * restores its name and the restore policy. The policies are only applied
+ * when either of them is set.
+ */
+void thread_switch(ThreadSwitch *saved, const char *name,
+                   const ThreadPolicy *policy, const ThreadPolicy *restore);
+void thread_switch_back(ThreadSwitch *saved);
+
+/*
+ * x264 starts its threads when the encoder is opened, they inherit the
+ * scheduling and the name of the calling thread. Encoders are opened
+ * between thread_switch_encoder() and thread_switch_back(), as a thread
+ * named "encoder" with the encoder policy, the capture policy being
+ * restored afterwards.
+ */
+void thread_switch_encoder(ThreadSwitch *saved, const ThreadPolicy *encoder,
+                           const ThreadPolicy *capture);
+
+// Names the calling thread, at most 15 characters are kept.
+void thread_set_name(const char *name);
+
+// The name of the calling thread, name holds 16 bytes.
+void thread_get_name(char *name);
+
+/*
+ * Records the CPU time of the threads of the process, to be reported once
+ * they have exited.
+ */
+void thread_times_sample(void);
+
+/*
+ * Prints the CPU time, last CPU, allowed CPUs and scheduling of the threads
+ * sampled so far.
+ */
+void thread_times_report(FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // ARP_THREAD_POLICY_H_
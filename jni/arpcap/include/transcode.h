@@ -21,7 +21,10 @@
 extern "C" {
 #endif
 
+#include <encoder.h>
 #include <filter.h>
+#include <loop.h>
+#include <thread_policy.h>
 #include <utils.h>
 
 #include <libavformat/avformat.h>
@@ -30,6 +33,7 @@ extern "C" {
 
 #define MAX_FILTERS   8
 #define PRESET_LENGTH 16
+#define ENCODER_LENGTH 8
 
 enum StreamType
 {
@@ -44,6 +48,7 @@ enum CodecID
 };
 
 typedef struct TranscodeParam {
+  int display;
   int top;
   int bottom;
   int width;
@@ -52,7 +57,28 @@ typedef struct TranscodeParam {
   int crf;
   int bitrate;
   int framerate;
+  int min_framerate;
+  // Frames between keyframes, or the period of the intra refresh.
+  int gop;
+  int intra_refresh;
+  int latest_frame;
+  int convert_threads;
+  int pixel_format;
+  int nv12;
+  int crop_x;
+  int crop_y;
+  int crop_width;
+  int crop_height;
+  int damage_tiles;
+  int roi_offset;
+  // The output thread captures, converts and feeds the encoder, the
+  // encoder threads are the ones x264 starts.
+  ThreadPolicy capture_policy;
+  ThreadPolicy encoder_policy;
+  EncoderThreads encoder_threads;
   char preset[PRESET_LENGTH];
+  // Filter encoding the pictures, av or x264.
+  char encoder[ENCODER_LENGTH];
   int package;
 } TranscodeParam;
 
@@ -71,7 +97,11 @@ typedef struct TranscodeContext {
   void *filter_data[MAX_FILTERS];
   void *priv_data;
 
+  EventLoop *loop;
   pthread_t thread;
+
+  // Set by the input filter.
+  double capture_rate;
 } TranscodeContext;
 
 #ifdef __cplusplus
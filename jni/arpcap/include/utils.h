@@ -23,13 +23,40 @@ extern "C" {
 
 #include <libavformat/avformat.h>
 
-#define PKT_MKSIZE(pkt, w, h) \
-  do  \
-  { \
-    (pkt)->pos = ((int64_t) (w) << 32) | (h); \
-  } while (0)
-#define PKT_WIDTH(pkt)        ((pkt)->pos >> 32)
-#define PKT_HEIGHT(pkt)       ((pkt)->pos & 0xFFFF)
+// Side data of the raw pictures, a PktFrame telling how the picture lies in
+// the packet data.
+#define PKT_DATA_FRAME \
+  ((enum AVPacketSideDataType) MKBETAG('F', 'R', 'M', 'E'))
+
+typedef struct PktFrame {
+  int width;
+  int height;
+  int format;           // enum AVPixelFormat
+  int linesize[4];
+  int offset[4];        // of each plane from the packet data
+  int64_t timestamp;    // capture time given by the display, in ns
+  uint64_t frame_number;
+} PktFrame;
+
+// Set on packets whose picture is identical to the previous packet.
+#define PKT_FLAG_UNCHANGED    0x10000
+
+// Side data of the pictures captured with damage tracking, a PktDamage
+// telling which tiles changed since the previous picture.
+#define PKT_DATA_DAMAGE \
+  ((enum AVPacketSideDataType) MKBETAG('D', 'M', 'G', 'T'))
+
+typedef struct PktDamage {
+  int tile_size;
+  int tiles_x;
+  int tiles_y;
+  // Followed by tiles_x * tiles_y bytes, row major, non-zero if changed.
+} PktDamage;
+
+#define PKT_DAMAGE_TILES(damage) ((const uint8_t *) ((damage) + 1))
+
+// The PktFrame of a raw picture, NULL if it has none.
+const PktFrame *pkt_get_frame(const AVPacket *pkt);
 
 int new_packet_from_data(AVPacket *pkt, uint8_t *data, int size);
 int new_packet_from_frame(AVPacket *pkt, AVFrame *frame);
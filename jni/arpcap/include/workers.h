@@ -0,0 +1,65 @@
+/*
+ * Copyright 2018 ARP Network
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ARP_WORKERS_H_
+#define ARP_WORKERS_H_
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Persistent pool of worker threads. The thread calling run() takes part in
+ * the work, so a pool of size 1 has no worker threads at all. Concurrent
+ * calls to run() from different threads are served one after the other.
+ */
+class WorkerPool
+{
+  public:
+    // Threads are named name-1 .. name-(size - 1).
+    WorkerPool(int size, const char *name);
+    ~WorkerPool();
+
+    int size() const;
+
+    // Calls task(0) .. task(count - 1) across the pool and returns once all
+    // of them have finished.
+    void run(int count, const std::function<void(int)> &task);
+
+  private:
+    void loop(int thread);
+    bool next(int *index);
+
+    std::vector<std::thread> mThreads;
+    std::string              mName;
+
+    const std::function<void(int)> *mTask;
+    int      mCount;
+    int      mNext;
+    int      mPending;
+    uint64_t mGeneration;
+    bool     mStopped;
+
+    std::mutex              mRunMutex;
+    std::mutex              mMutex;
+    std::condition_variable mStart;
+    std::condition_variable mDone;
+};
+
+#endif  // ARP_WORKERS_H_
@@ -0,0 +1,133 @@
+/*
+ * Copyright 2018 ARP Network
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <alloc.h>
+
+#include <libavutil/common.h>
+#include <libavutil/log.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+
+#define HUGE_PAGE_SIZE (2 << 20)
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+
+static int use_hugepages = 0;
+// Few systems reserve explicit huge pages, they are not tried again once
+// the mapping failed.
+static int no_explicit_hugepages = 0;
+static int no_transparent_hugepages = 0;
+
+static uint8_t *map_hugepages(size_t size);
+static void free_mapping(void *opaque, uint8_t *data);
+static void free_aligned(void *opaque, uint8_t *data);
+
+void frame_alloc_use_hugepages(int enable)
+{
+  use_hugepages = enable;
+}
+
+AVBufferRef *frame_buffer_alloc(int size)
+{
+  AVBufferRef *buf = NULL;
+
+  if (use_hugepages)
+  {
+    size_t length = FFALIGN((size_t) size, HUGE_PAGE_SIZE);
+    uint8_t *data = map_hugepages(length);
+    if (data != NULL)
+    {
+      buf = av_buffer_create(data, size, free_mapping, (void *) (uintptr_t) length, 0);
+      if (buf == NULL)
+      {
+        munmap(data, length);
+      }
+      return buf;
+    }
+  }
+
+  void *data = NULL;
+  if (posix_memalign(&data, FRAME_ALIGN, size) != 0)
+  {
+    return NULL;
+  }
+  buf = av_buffer_create(data, size, free_aligned, NULL, 0);
+  if (buf == NULL)
+  {
+    free(data);
+  }
+
+  return buf;
+}
+
+// Maps size bytes, a multiple of the huge page size, on a huge page boundary.
+uint8_t *map_hugepages(size_t size)
+{
+  if (!no_explicit_hugepages)
+  {
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (data != MAP_FAILED)
+    {
+      return data;
+    }
+    no_explicit_hugepages = 1;
+    av_log(NULL, AV_LOG_INFO, "No explicit huge pages, using transparent huge pages.\n");
+  }
+
+  // Transparent huge pages only back aligned ranges, map a huge page more
+  // and trim both ends.
+  size_t length = size + HUGE_PAGE_SIZE;
+  uint8_t *mapping = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
+  {
+    return NULL;
+  }
+  uint8_t *data = (uint8_t *) FFALIGN((uintptr_t) mapping, HUGE_PAGE_SIZE);
+  if (data > mapping)
+  {
+    munmap(mapping, data - mapping);
+  }
+  munmap(data + size, mapping + length - (data + size));
+
+  if (madvise(data, size, MADV_HUGEPAGE) != 0 && !no_transparent_hugepages)
+  {
+    no_transparent_hugepages = 1;
+    av_log(NULL, AV_LOG_WARNING, "Transparent huge pages are not available.\n");
+  }
+
+  return data;
+}
+
+void free_mapping(void *opaque, uint8_t *data)
+{
+  munmap(data, (size_t) (uintptr_t) opaque);
+}
+
+void free_aligned(void *opaque, uint8_t *data)
+{
+  (void) opaque;
+  free(data);
+}
@@ -14,6 +14,9 @@
  * limitations under the License.
  */
 
+#include <alloc.h>
+#include <cap.h>
+#include <thread_policy.h>
 #include <transcode.h>
 
 #include <libavcodec/avcodec.h>
@@ -29,6 +32,11 @@
 
 #define DEFAULT_FRAMERATE 15
 #define DEFAULT_PRESET    "veryfast"
+#define DEFAULT_ENCODER   "av"
+#define DEFAULT_CONVERT_THREADS 1
+#define DEFAULT_GOP       100
+
+#define MAX_OUTPUTS 8
 
 static void print_usage_and_exit(const char *cmd);
 static char *parse_protocol_name(const char *addr);
@@ -39,11 +47,16 @@ static int  init_filters(TranscodeContext *ctx);
 static int  add_filter(TranscodeContext *ctx, const char *name);
 static int  apply_filters(TranscodeContext *ctx, AVPacket *pkt);
 static int  apply_filter(TranscodeContext *ctx, int index, AVPacket *pkt);
+static void flush_filters(TranscodeContext *ctx);
 
 static void *av_thread(void *opaque);
 static void sigroutine(int signum);
+static void abort_all();
 
 static int aborted = 0;
+// One pipeline, with its own loop and thread, per output.
+static TranscodeContext videos[MAX_OUTPUTS];
+static int nb_videos = 0;
 
 int main(int argc, char *argv[])
 {
@@ -52,7 +65,17 @@ int main(int argc, char *argv[])
   TranscodeParam param;
   memset(&param, 0, sizeof (param));
   param.framerate = DEFAULT_FRAMERATE;
+  param.convert_threads = DEFAULT_CONVERT_THREADS;
+  param.gop = DEFAULT_GOP;
   strcpy(param.preset, DEFAULT_PRESET);
+  strcpy(param.encoder, DEFAULT_ENCODER);
+  param.encoder_threads.lookahead = -1;
+  param.encoder_threads.sync_lookahead = -1;
+
+  // Options apply to the outputs that follow them.
+  TranscodeParam params[MAX_OUTPUTS];
+  char *outputs[MAX_OUTPUTS];
+  int nb_outputs = 0;
 
   struct option long_options[] = {
       { "bitrate",          required_argument, NULL, 'b' },
@@ -60,26 +83,69 @@ int main(int argc, char *argv[])
       { "video-size",       required_argument, NULL, 's' },
       { "crop-top",         required_argument, NULL, 'T' },
       { "crop-bottom",      required_argument, NULL, 'B' },
+      { "crop",             required_argument, NULL, 'C' },
+      { "display",          required_argument, NULL, 'd' },
       { "framerate",        required_argument, NULL, 'r' },
+      { "adaptive-framerate", required_argument, NULL, 'a' },
+      { "gop",              required_argument, NULL, 'g' },
+      { "intra-refresh",    no_argument,       NULL, 'I' },
+      { "latest-frame",     no_argument,       NULL, 'L' },
+      { "convert-threads",  required_argument, NULL, 't' },
+      { "pixel-format",     required_argument, NULL, 'f' },
+      { "nv12",             no_argument,       NULL, 'n' },
+      { "damage-tiles",     no_argument,       NULL, 'D' },
+      { "roi-offset",       required_argument, NULL, 'R' },
+      { "hugepages",        no_argument,       NULL, 'H' },
+      { "capture-cpus",     required_argument, NULL, 'X' },
+      { "capture-fifo",     required_argument, NULL, 'F' },
+      { "capture-nice",     required_argument, NULL, 'N' },
+      { "encoder-cpus",     required_argument, NULL, 'E' },
+      { "encoder-threads",  required_argument, NULL, 'j' },
+      { "thread-type",      required_argument, NULL, 'y' },
+      { "lookahead",        required_argument, NULL, 'l' },
+      { "sync-lookahead",   required_argument, NULL, 'k' },
       { "preset",           required_argument, NULL, 'P' },
+      { "encoder",          required_argument, NULL, 'e' },
       { "package",          no_argument,       NULL, 'p' },
       { "verbose",          no_argument,       NULL, 'v' },
       { NULL,               0,                 NULL, 0   }
   };
 
+  // Set by output options given after the last output.
+  int trailing = 0;
+
   int c = 0;
   while (1)
   {
     int option_index = 0;
 
-    c = getopt_long(argc, argv, "b:c:s:r:p", long_options, &option_index);
+    c = getopt_long(argc, argv, "-b:c:s:r:p", long_options, &option_index);
     if (c == -1)
     {
       break;
     }
+    // --verbose and --hugepages apply to the process.
+    if (c == 1)
+    {
+      trailing = 0;
+    }
+    else if (c != 'v' && c != 'H')
+    {
+      trailing = 1;
+    }
 
     switch (c)
     {
+    case 1:
+      if (nb_outputs == MAX_OUTPUTS)
+      {
+        print_usage_and_exit(argv[0]);
+      }
+      params[nb_outputs] = param;
+      outputs[nb_outputs] = optarg;
+      nb_outputs++;
+      break;
+
     case 'b':
       param.bitrate = atoi(optarg);
       break;
@@ -100,15 +166,160 @@ int main(int argc, char *argv[])
       param.bottom = atoi(optarg);
       break;
 
+    case 'C':
+      if (sscanf(optarg, "%d,%d,%d,%d", &param.crop_x, &param.crop_y,
+                 &param.crop_width, &param.crop_height) != 4 ||
+          param.crop_x < 0 || param.crop_y < 0 ||
+          param.crop_width <= 0 || param.crop_height <= 0 ||
+          (param.crop_width & 1) || (param.crop_height & 1))
+      {
+        print_usage_and_exit(argv[0]);
+      }
+      break;
+
+    case 'd':
+      param.display = atoi(optarg);
+      break;
+
     case 'r':
       param.framerate = atoi(optarg);
       break;
 
+    case 'g':
+      param.gop = atoi(optarg);
+      if (param.gop < 1)
+      {
+        print_usage_and_exit(argv[0]);
+      }
+      break;
+
+    case 'I':
+      param.intra_refresh = 1;
+      break;
+
+    case 'a':
+      if (sscanf(optarg, "%d-%d", &param.min_framerate, &param.framerate) != 2 ||
+          param.min_framerate <= 0 || param.min_framerate > param.framerate)
+      {
+        print_usage_and_exit(argv[0]);
+      }
+      // Motion is measured on the changed tiles.
+      param.damage_tiles = 1;
+      break;
+
+    case 'L':
+      param.latest_frame = 1;
+      break;
+
+    case 't':
+      param.convert_threads = atoi(optarg);
+      break;
+
+    case 'f':
+      param.pixel_format = cap_pixel_format(optarg);
+      if (param.pixel_format < 0)
+      {
+        print_usage_and_exit(argv[0]);
+      }
+      break;
+
+    case 'n':
+      param.nv12 = 1;
+      break;
+
+    case 'D':
+      param.damage_tiles = 1;
+      break;
+
+    case 'R':
+      param.roi_offset = atoi(optarg);
+      if (param.roi_offset > 0)
+      {
+        param.damage_tiles = 1;
+      }
+      break;
+
+    case 'H':
+      // Shared by all outputs.
+      frame_alloc_use_hugepages(1);
+      break;
+
+    case 'X':
+      if (thread_parse_cpus(optarg, &param.capture_policy.cpus) < 0)
+      {
+        print_usage_and_exit(argv[0]);
+      }
+      break;
+
+    case 'F':
+      param.capture_policy.fifo_priority = atoi(optarg);
+      break;
+
+    case 'N':
+      param.capture_policy.nice = atoi(optarg);
+      param.capture_policy.set_nice = 1;
+      // Encoder threads keep the default nice level.
+      param.encoder_policy.set_nice = 1;
+      break;
+
+    case 'E':
+      if (thread_parse_cpus(optarg, &param.encoder_policy.cpus) < 0)
+      {
+        print_usage_and_exit(argv[0]);
+      }
+      break;
+
+    case 'j':
+      if (strcmp(optarg, "auto") == 0)
+      {
+        param.encoder_threads.threads = ENCODER_THREADS_AUTO;
+      }
+      else
+      {
+        param.encoder_threads.threads = atoi(optarg);
+        if (param.encoder_threads.threads < 1)
+        {
+          print_usage_and_exit(argv[0]);
+        }
+      }
+      break;
+
+    case 'y':
+      if (strcmp(optarg, "frame") == 0)
+      {
+        param.encoder_threads.type = THREAD_TYPE_FRAME;
+      }
+      else if (strcmp(optarg, "slice") == 0)
+      {
+        param.encoder_threads.type = THREAD_TYPE_SLICE;
+      }
+      else
+      {
+        print_usage_and_exit(argv[0]);
+      }
+      break;
+
+    case 'l':
+      param.encoder_threads.lookahead = atoi(optarg);
+      break;
+
+    case 'k':
+      param.encoder_threads.sync_lookahead = atoi(optarg);
+      break;
+
     case 'P':
       strncpy(param.preset, optarg, PRESET_LENGTH - 1);
       param.preset[PRESET_LENGTH - 1] = '\0';
       break;
 
+    case 'e':
+      if (strcmp(optarg, "av") != 0 && strcmp(optarg, "x264") != 0)
+      {
+        print_usage_and_exit(argv[0]);
+      }
+      strcpy(param.encoder, optarg);
+      break;
+
     case 'p':
       param.package = 1;
       break;
@@ -123,23 +334,52 @@ int main(int argc, char *argv[])
     }
   }
 
-  if (argc - optind != 1)
+  if (nb_outputs == 0 || optind != argc)
   {
     print_usage_and_exit(argv[0]);
   }
-
-  char *output = argv[optind];
-
-  filter_register_all();
-
-  char names[BUFSIZ];
-  char *oname = parse_protocol_name(output);
-  if (oname == NULL)
+  if (trailing)
   {
-    fprintf(stderr, "invalid output.\n");
-    free(oname);
+    fprintf(stderr, "options must come before the output they apply to.\n");
     exit(-1);
   }
+  // The conversion threads are shared by the outputs, they are placed with
+  // the policy of the output that starts them.
+  for (int i = 1; i < nb_outputs; i++)
+  {
+    if (params[i].convert_threads != params[0].convert_threads)
+    {
+      fprintf(stderr, "--convert-threads must be the same for all outputs.\n");
+      exit(-1);
+    }
+    const ThreadPolicy *policy = &params[i].capture_policy;
+    const ThreadPolicy *first = &params[0].capture_policy;
+    if (policy->cpus != first->cpus || policy->fifo_priority != first->fifo_priority ||
+        policy->set_nice != first->set_nice || policy->nice != first->nice)
+    {
+      fprintf(stderr, "--capture-cpus, --capture-fifo and --capture-nice must be the same "
+              "for all outputs.\n");
+      exit(-1);
+    }
+  }
+  // libavcodec has no way to pass quant offsets to libx264.
+  for (int i = 0; i < nb_outputs; i++)
+  {
+    if (params[i].roi_offset > 0 && strcmp(params[i].encoder, "x264") != 0)
+    {
+      fprintf(stderr, "--roi-offset needs --encoder=x264.\n");
+      exit(-1);
+    }
+    // The refresh column would be coded with the offsets, it is the
+    // keyframe there.
+    if (params[i].roi_offset > 0 && params[i].intra_refresh)
+    {
+      fprintf(stderr, "--roi-offset does not work with --intra-refresh.\n");
+      exit(-1);
+    }
+  }
+
+  filter_register_all();
 
   signal(SIGINT, sigroutine);
   signal(SIGTERM, sigroutine);
@@ -148,27 +388,54 @@ int main(int argc, char *argv[])
     av_log_set_level(AV_LOG_WARNING);
   }
 
-  TranscodeContext video = {
-    .type = ST_VIDEO,
-    .param = param,
-    .output = output
-  };
-
-  int rc = 0;
-  snprintf(names, BUFSIZ, "cap:repeat:av:%s:%s",
-           verbose ? "stat" : "",
-           oname);
-  video.filter_graph = strdup(names);
-  if (verbose)
+  for (int i = 0; i < nb_outputs; i++)
   {
-    fprintf(stderr, "use video filters '%s'.\n", names);
+    char names[BUFSIZ];
+    char *oname = parse_protocol_name(outputs[i]);
+    if (oname == NULL)
+    {
+      fprintf(stderr, "invalid output.\n");
+      exit(-1);
+    }
+
+    EventLoop *loop = loop_create(); assert(loop != NULL);
+
+    TranscodeContext *video = &videos[nb_videos];
+    video->type = ST_VIDEO;
+    video->param = params[i];
+    video->output = outputs[i];
+    video->loop = loop;
+
+    int rc = 0;
+    snprintf(names, BUFSIZ, "cap:repeat:%s:%s:%s",
+             video->param.encoder,
+             verbose ? "stat" : "",
+             oname);
+    free(oname);
+    video->filter_graph = strdup(names);
+    if (verbose)
+    {
+      fprintf(stderr, "use video filters '%s' for %s.\n", names, outputs[i]);
+    }
+
+    rc = init_filters(video); assert(rc >= 0);
+    nb_videos++;
   }
 
-  rc = init_filters(&video); assert(rc >= 0);
-  pthread_create(&video.thread, NULL, av_thread, &video);
-  pthread_join(video.thread, NULL);
+  for (int i = 0; i < nb_videos; i++)
+  {
+    pthread_create(&videos[i].thread, NULL, av_thread, &videos[i]);
+  }
+  for (int i = 0; i < nb_videos; i++)
+  {
+    pthread_join(videos[i].thread, NULL);
+    free(videos[i].filter_graph);
+  }
 
-  free(video.filter_graph);
+  if (verbose)
+  {
+    thread_times_report(stderr);
+  }
 
   fprintf(stderr, "\nCompleted.\n");
 
@@ -178,17 +445,62 @@ int main(int argc, char *argv[])
 void print_usage_and_exit(const char *cmd)
 {
   fprintf(stderr, "\
-Usage: %s [OPTION] OUTPUT\n\
+Usage: %s [OPTION]... OUTPUT [[OPTION]... OUTPUT]...\n\
+Each OUTPUT is captured and encoded by its own pipeline, with the options\n\
+given before it.\n\
   -b, --bitrate=BITRATE         Set bitrate (kbit/s)\n\
   -c, --crf=CRF                 Quality-based VBR (0-51) [23]\n\
   -s, --video-size=WxH          Set video size (WxH)\n\
       --crop-top=TOP            Crop the top\n\
       --crop-bottom=BOTTOM      Crop the bottom\n\
+      --crop=X,Y,W,H            Capture only a region of the screen, the video\n\
+                                size then applies to the region. W and H are\n\
+                                even and positive\n\
+      --display=ID              Display to capture [0]\n\
   -r, --framerate=RATE          Specify framerate [15]\n\
+      --adaptive-framerate=MIN-MAX\n\
+                                Capture at MAX fps on motion, slowing down to\n\
+                                MIN fps on a static screen, implies\n\
+                                --damage-tiles. The first change after a\n\
+                                static period waits up to 1/MIN s\n\
+      --gop=FRAMES              Frames between IDR frames, or between intra\n\
+                                refresh waves [100]\n\
+      --intra-refresh           Refresh the picture with a moving column of\n\
+                                intra macroblocks instead of IDR frames\n\
+      --latest-frame            Only acquire the latest frame, dropping stale\n\
+                                frames without touching their buffers\n\
+      --convert-threads=N       Threads converting captured frames [1]\n\
+      --pixel-format=FORMAT     Pixel format requested from the display\n\
+                                - rgba,bgra,rgb565\n\
+      --nv12                    Feed the encoder NV12 instead of I420\n\
+      --damage-tiles            Only convert screen tiles that changed, static\n\
+                                frames are not sent to the encoder\n\
+      --roi-offset=QP           Raise the QP of regions that did not change,\n\
+                                implies --damage-tiles, needs --encoder=x264,\n\
+                                not with --intra-refresh\n\
+      --hugepages               Back the frame buffers with huge pages\n\
+      --capture-cpus=LIST       CPUs of the capture and conversion threads,\n\
+                                e.g. 4-7\n\
+      --capture-fifo=PRIO       Run the capture and conversion threads with\n\
+                                SCHED_FIFO priority PRIO\n\
+      --capture-nice=NICE       Nice level of the capture and conversion\n\
+                                threads\n\
+      --encoder-cpus=LIST       CPUs of the encoder threads\n\
+      --encoder-threads=N       Encoder threads, or auto to pick them from the\n\
+                                encoder CPUs and the video size [x264's]\n\
+      --thread-type=TYPE        Split frames in slices, or encode frames in\n\
+                                parallel at a frame of latency per thread\n\
+                                [slice]\n\
+                                - frame,slice\n\
+      --lookahead=FRAMES        Frames of rate control lookahead [0]\n\
+      --sync-lookahead=FRAMES   Frames buffered for frame threads [0]\n\
       --preset=PRESET           Use a preset to select encoding settings [veryfast]\n\
                                 Overridden by user settings.\n\
                                 - ultrafast,superfast,veryfast,faster,fast\n\
                                 - medium,slow,slower,veryslow,placebo\n\
+      --encoder=ENCODER         Encode through libavcodec or call libx264\n\
+                                directly [av]\n\
+                                - av,x264\n\
   -p, --package                 Package output\n\
       --verbose                 Verbose output\n", cmd);
   exit(-1);
@@ -324,10 +636,54 @@ int apply_filter(TranscodeContext *ctx, int index, AVPacket *pkt)
   return ret;
 }
 
+void flush_filters(TranscodeContext *ctx)
+{
+  AVPacket pkt;
+  pkt.data = NULL;
+  pkt.size = 0;
+  av_init_packet(&pkt);
+
+  for (int i = 0; i < ctx->nb_filters; i++)
+  {
+    Filter *filter = ctx->filters[i];
+    if (filter->flush == NULL) continue;
+
+    while (1)
+    {
+      ctx->priv_data = ctx->filter_data[i];
+      int ret = filter->flush(ctx, &pkt);
+      ctx->priv_data = NULL;
+      if (ret < 0)
+      {
+        break;
+      }
+
+      for (int j = i + 1; j < ctx->nb_filters; j++)
+      {
+        ret = apply_filter(ctx, j, &pkt);
+        if (ret < 0 && ret != AVERROR(EAGAIN))
+        {
+          break;
+        }
+      }
+      av_packet_unref(&pkt);
+    }
+  }
+}
+
 void *av_thread(void *opaque)
 {
   TranscodeContext *ctx = (TranscodeContext *) opaque;
 
+  char name[16];
+  snprintf(name, sizeof (name), "output-%d", (int) (ctx - videos));
+  thread_set_name(name);
+  // Before the filters start, the conversion threads inherit it.
+  if (thread_policy_isset(&ctx->param.capture_policy))
+  {
+    thread_apply_policy(&ctx->param.capture_policy);
+  }
+
   int ret = filters_init(ctx);
   if (ret < 0)
   {
@@ -344,6 +700,11 @@ void *av_thread(void *opaque)
     ret = apply_filters(ctx, &pkt);
     if (ret == AVERROR(EAGAIN))
     {
+      // Nothing to do until a filter's fd fires: a new frame, a timer or abort.
+      if (loop_wait(ctx->loop, -1) < 0)
+      {
+        break;
+      }
       continue;
     }
     else if (ret < 0)
@@ -352,9 +713,16 @@ void *av_thread(void *opaque)
     }
   }
 
+  // Frames still in the encoders go out before the outputs close.
+  flush_filters(ctx);
+
+  // While the encoder threads are still there.
+  thread_times_sample();
+
   filters_fini(ctx);
 
-  aborted = 1;
+  // The other pipelines stop along.
+  abort_all();
 
   return NULL;
 }
@@ -363,5 +731,14 @@ void sigroutine(int signum)
 {
   (void) signum;
 
+  abort_all();
+}
+
+void abort_all()
+{
   aborted = 1;
+  for (int i = 0; i < nb_videos; i++)
+  {
+    loop_wakeup(videos[i].loop);
+  }
 }
@@ -16,209 +16,1343 @@
 
 #include "cap.h"
 
+#include <alloc.h>
 #include <libyuv.h>
 #include <ScreenCapture.h>
 #include <utils.h>
+#include <workers.h>
 
-#include <chrono>
-#include <condition_variable>
+extern "C" {
+#include <libavutil/time.h>
+}
+
+#include <algorithm>
+#include <atomic>
 #include <mutex>
+#include <vector>
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 
-#define RGBA_BPP    4
+#define CAP_BUFFERS 4
+
+// Rows converted at once through an intermediate buffer, when NV12 is
+// produced through I420 or a format through ARGB.
+#define CHUNK_ROWS 16
+// Output rows scaled and converted at once when downscaling.
+#define SCALE_CHUNK_ROWS 16
+// Width and height of the tiles compared for damage tracking.
+#define DAMAGE_TILE_SIZE 64
+// With an adaptive frame rate, the rate halves every half life (ns) of
+// static screen.
+#define ADAPTIVE_HALF_LIFE 500000000LL
 
 #define LOGE(format, ...) fprintf(stderr, "[ARPCAP] " format "\n", ##__VA_ARGS__)
 
+// Entry points added after version 1 of the capture API. Device libraries
+// built before them do not export them, they resolve to null there.
+extern "C" {
+int arpcap_get_api_version() __attribute__((weak));
+int arpcap_set_pixel_format(int32_t format) __attribute__((weak));
+int arpcap_acquire_frame(ARPFrame *frame) __attribute__((weak));
+void arpcap_release_frame(int32_t handle) __attribute__((weak));
+int arpcap_discard_frames(uint32_t count) __attribute__((weak));
+int arpcap_get_display_info_for(uint32_t display, ARPDisplayInfo *info) __attribute__((weak));
+ARPSession *arpcap_session_create(
+    const ARPSessionParams *params, arp_session_callback cb, void *opaque) __attribute__((weak));
+void arpcap_session_destroy(ARPSession *session) __attribute__((weak));
+int arpcap_session_acquire_frame(ARPSession *session, ARPFrame *frame) __attribute__((weak));
+void arpcap_session_release_frame(ARPSession *session, int32_t handle) __attribute__((weak));
+int arpcap_session_discard_frames(ARPSession *session, uint32_t count) __attribute__((weak));
+}
+
+class CaptureSource;
+class FrameRunner;
+
 struct Cap {
   int width;
   int height;
+  bool nv12;
+
+  // Size requested from the display. Larger frames are downscaled to it
+  // while being converted.
+  int target_width;
+  int target_height;
+  int src_width;
+  int src_height;
 
-  AVPacket *pkt;
-  uint8_t *data[3];
+  // Region of the frame to capture, in frame coordinates. Empty for the
+  // whole frame.
+  int crop_x;
+  int crop_y;
+  int crop_width;
+  int crop_height;
+
+  // Ring of I420 or NV12 buffers; a buffer returns to the pool once the last packet
+  // or encoder frame referencing it is unreferenced.
+  AVBufferPool *pool;
+  int nb_buffers;
+  int size;
+  int offset[3];
   int linesize[3];
+
+  CaptureSource *source;
+  FrameRunner *runner;
+
+  // Frames are converted in horizontal bands, one per worker, each with
+  // its own scratch buffer. The pool is shared by every capture of the
+  // process.
+  WorkerPool *workers;
+  std::vector<std::vector<uint8_t>> scratch;
+
+  // Damage tracking: only tiles whose hash changed since the previous frame
+  // are converted, the others are copied from the previous output buffer.
+  bool damage_tiles;
+  bool damage;  // unless downscaling
+  int tiles_x;
+  int tiles_y;
+  std::vector<uint64_t> tile_hashes;
+  std::vector<uint8_t> tile_dirty;
+  bool hashes_valid;
+  AVBufferRef *last;
+  int64_t dirty_tiles;
+  int64_t total_tiles;
+  int unchanged_frames;
+  int reported_frames;  // frames whose damage came from the display
+
+  int frames;
+  int64_t convert_time;
+};
+
+typedef int (*ToI420Func)(const uint8_t *src, int src_stride,
+                          uint8_t *dst_y, int dst_stride_y,
+                          uint8_t *dst_u, int dst_stride_u,
+                          uint8_t *dst_v, int dst_stride_v,
+                          int width, int height);
+
+typedef int (*ToNV12Func)(const uint8_t *src, int src_stride,
+                          uint8_t *dst_y, int dst_stride_y,
+                          uint8_t *dst_uv, int dst_stride_uv,
+                          int width, int height);
+
+typedef int (*ToARGBFunc)(const uint8_t *src, int src_stride,
+                          uint8_t *dst_argb, int dst_stride_argb,
+                          int width, int height);
+
+struct PixelFormat {
+    int32_t    format;
+    int        bpp;
+    ToI420Func toI420;  // optional, otherwise converted through ARGB
+    ToNV12Func toNV12;  // optional, otherwise converted through I420
+    ToARGBFunc toARGB;  // for formats that cannot be scaled as 32 bit pixels
+};
+
+// Android names formats by byte order, libyuv by little endian word order.
+static const PixelFormat kPixelFormats[] = {
+    { PIXEL_FORMAT_RGBA_8888,    4, libyuv::ABGRToI420,   nullptr,            nullptr              },
+    { PIXEL_FORMAT_RGBX_8888,    4, libyuv::ABGRToI420,   nullptr,            nullptr              },
+    { PIXEL_FORMAT_BGRA_8888,    4, libyuv::ARGBToI420,   libyuv::ARGBToNV12, nullptr              },
+    { PIXEL_FORMAT_RGB_888,      3, libyuv::RAWToI420,    nullptr,            libyuv::RAWToARGB    },
+    { PIXEL_FORMAT_RGB_565,      2, libyuv::RGB565ToI420, nullptr,            libyuv::RGB565ToARGB },
+    // No direct 10 bit converter. AR30ToABGR swaps red and blue, which turns
+    // AB30 into ARGB.
+    { PIXEL_FORMAT_RGBA_1010102, 4, nullptr,              nullptr,            libyuv::AR30ToABGR   },
+};
+
+static const PixelFormat *find_pixel_format(int32_t format) {
+    for (const PixelFormat &pf : kPixelFormats) {
+        if (pf.format == format) {
+            return &pf;
+        }
+    }
+    return nullptr;
+}
+
+// Adds the damage of src to dst. When the rects do not fit, those of dst are
+// replaced by their bounds.
+static void merge_damage(ARPFrame *dst, const ARPFrame &src) {
+    if (dst->num_damage_rects < 0 || src.num_damage_rects < 0) {
+        dst->num_damage_rects = -1;
+        return;
+    }
+
+    for (int i = 0; i < src.num_damage_rects; i++) {
+        if (dst->num_damage_rects == ARP_MAX_DAMAGE_RECTS) {
+            ARPRect &bounds = dst->damage_rects[0];
+            for (int j = 1; j < dst->num_damage_rects; j++) {
+                const ARPRect &rect = dst->damage_rects[j];
+                bounds.left = std::min(bounds.left, rect.left);
+                bounds.top = std::min(bounds.top, rect.top);
+                bounds.right = std::max(bounds.right, rect.right);
+                bounds.bottom = std::max(bounds.bottom, rect.bottom);
+            }
+            dst->num_damage_rects = 1;
+        }
+        dst->damage_rects[dst->num_damage_rects++] = src.damage_rects[i];
+    }
+}
+
+/*
+ * Frames of a capture session or, with libraries older than version 3, of
+ * the single capture of the process. Version 1 lends one buffer at a time
+ * and drops frames by acquiring them: discarded frames are dropped before
+ * the next acquire(), on the thread of the reader. The FrameRunner
+ * serializes the calls.
+ */
+class CaptureSource
+{
+  public:
+    static CaptureSource *create(int version, const ARPSessionParams &params, FrameRunner *runner);
+    ~CaptureSource();
+
+    int acquire(ARPFrame *frame);
+    void release(int32_t handle);
+    int discard(int count);
+
+    // Whether a frame can be acquired while the reader holds another.
+    bool holdsSeveral() const { return mVersion >= 2; }
+
+  private:
+    CaptureSource(int version, ARPSession *session);
+
+    int         mVersion;
+    ARPSession *mSession;
+    bool        mHeld;
+    int         mDeferred;
 };
 
 class FrameRunner
 {
   public:
-    FrameRunner(int framerate);
+    FrameRunner(int framerate, int minFramerate, bool latestOnly);
+    ~FrameRunner();
+
+    // Frames may be signalled before the source is set.
+    void setSource(CaptureSource *source);
+    // Releases the frame held for the reader and stops using the source,
+    // before it is destroyed.
+    void detach();
+
+    int fd() const;
+    double framerate();
 
-    void onFrameAvailable(uint64_t frameNumber, int64_t timestamp);
+    void onFrameAvailable(int64_t timestamp);
+    // Called for frames that changed, bringing the rate back to the maximum
+    // from the next frame. Changes are only seen on the frames converted,
+    // up to a frame delay of the minimum rate after they happen.
+    void onMotion(int64_t timestamp);
 
-    int lock(ARPFrameBuffer *fb);
-    void release();
+    int lock(ARPFrame *frame);
+    void release(const ARPFrame &frame);
+    // Releases a frame that was not converted, its damage is added to the
+    // next frame returned by lock().
+    void drop(const ARPFrame &frame);
+
+    // Logs the intervals between the frames returned by lock().
+    void logPacing();
 
   private:
-    int     mFramerate;
-    int     mPendingFrames;
-    int     mPendingReleased;
-    bool    mLocked;
+    void discard(int count);
+    void updateFrameDelay(int64_t timestamp);
+    bool isDue(int64_t timestamp);
+    void advance(int64_t timestamp);
+
+    CaptureSource *mSource;
+
+    int      mFramerate;
+    bool     mLatestOnly;
+    int      mQueuedFrames;
+    bool     mReady;
+    bool     mHasFrame;
+    ARPFrame mFrame;
+    // Only the damage of the dropped frames is used.
+    ARPFrame mDropped;
 
     int64_t mFrameDelay;
+    int64_t mMinFrameDelay;
+    int64_t mMaxFrameDelay;
     int64_t mLastUpdated;
+    int64_t mLastMotion;
+    int64_t mNextDeadline;
+    int64_t mVsyncPeriod;
+    int64_t mLastTimestamp;
 
-    std::mutex              mMutex;
-    std::condition_variable mCondition;
+    int64_t mLastLocked;
+    int     mIntervals;
+    double  mIntervalSum;
+    double  mIntervalSquares;
+    double  mMaxInterval;
+
+    // Signalled whenever a frame becomes due.
+    int        mEventFd;
+    std::mutex mMutex;
 };
 
-static FrameRunner *sFRunner = nullptr;
+// Shared by the captures of the process.
+static std::mutex sSharedMutex;
+static int sCaptures = 0;
+static WorkerPool *sWorkers = nullptr;
+// Runner of the capture of libraries older than version 3, whose callback
+// has no opaque pointer.
+static FrameRunner *sLegacyRunner = nullptr;
+
+// The version of the capture library. Those without arpcap_get_api_version()
+// are version 1, those missing the entry points of their version are taken
+// for older.
+static int api_version() {
+    int version = arpcap_get_api_version != nullptr ? arpcap_get_api_version() : 1;
+    if (version >= 3 && arpcap_session_create == nullptr) {
+        version = 2;
+    }
+    if (version >= 2 && arpcap_acquire_frame == nullptr) {
+        version = 1;
+    }
+    return version;
+}
+
+static int get_display_info(int version, uint32_t display, ARPDisplayInfo *info) {
+    if (version >= 3) {
+        return arpcap_get_display_info_for(display, info);
+    }
+    return display == 0 ? arpcap_get_display_info(info) : -1;
+}
+
+CaptureSource::CaptureSource(int version, ARPSession *session) :
+    mVersion(version),
+    mSession(session),
+    mHeld(false),
+    mDeferred(0)
+{
+}
+
+CaptureSource *CaptureSource::create(int version, const ARPSessionParams &params, FrameRunner *runner) {
+    if (version >= 3) {
+        auto cb = [](void *opaque, uint64_t, int64_t timestamp) {
+            static_cast<FrameRunner *>(opaque)->onFrameAvailable(timestamp);
+        };
+        ARPSession *session = arpcap_session_create(&params, cb, runner);
+        return session != nullptr ? new CaptureSource(version, session) : nullptr;
+    }
+
+    std::unique_lock<std::mutex> lock(sSharedMutex);
+
+    if (sLegacyRunner != nullptr || params.display != 0) {
+        LOGE("Capture API version %d only captures display 0, once.", version);
+        return nullptr;
+    }
+    if (params.format != PIXEL_FORMAT_NONE &&
+        (arpcap_set_pixel_format == nullptr || arpcap_set_pixel_format(params.format) != 0)) {
+        return nullptr;
+    }
+
+    sLegacyRunner = runner;
+    auto cb = [](uint64_t, int64_t timestamp) {
+        sLegacyRunner->onFrameAvailable(timestamp);
+    };
+    if (arpcap_create(params.padding_top, params.padding_bottom, params.width, params.height, cb) != 0) {
+        sLegacyRunner = nullptr;
+        return nullptr;
+    }
+    return new CaptureSource(version, nullptr);
+}
+
+CaptureSource::~CaptureSource() {
+    if (mSession != nullptr) {
+        arpcap_session_destroy(mSession);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(sSharedMutex);
+    arpcap_destroy();
+    sLegacyRunner = nullptr;
+}
 
-FrameRunner::FrameRunner(int framerate) :
+int CaptureSource::acquire(ARPFrame *frame) {
+    if (mVersion >= 3) {
+        return arpcap_session_acquire_frame(mSession, frame);
+    } else if (mVersion == 2) {
+        return arpcap_acquire_frame(frame);
+    }
+
+    if (mHeld) {
+        return -1;
+    }
+    ARPFrameBuffer fb;
+    while (mDeferred > 0 && arpcap_acquire_frame_buffer(&fb) == 0) {
+        arpcap_release_frame_buffer();
+        mDeferred--;
+    }
+    mDeferred = 0;
+    if (arpcap_acquire_frame_buffer(&frame->fb) != 0) {
+        return -1;
+    }
+    mHeld = true;
+    frame->handle = 0;
+    frame->num_damage_rects = -1;
+    return 0;
+}
+
+void CaptureSource::release(int32_t handle) {
+    if (mVersion >= 3) {
+        arpcap_session_release_frame(mSession, handle);
+        return;
+    } else if (mVersion == 2) {
+        arpcap_release_frame(handle);
+        return;
+    }
+
+    arpcap_release_frame_buffer();
+    mHeld = false;
+}
+
+int CaptureSource::discard(int count) {
+    if (mVersion >= 3) {
+        return arpcap_session_discard_frames(mSession, count);
+    } else if (mVersion == 2) {
+        return arpcap_discard_frames(count);
+    }
+
+    mDeferred += count;
+    return count;
+}
+
+FrameRunner::FrameRunner(int framerate, int minFramerate, bool latestOnly) :
+    mSource(nullptr),
     mFramerate(framerate),
-    mPendingFrames(0),
-    mPendingReleased(0),
-    mLocked(false),
+    mLatestOnly(latestOnly),
+    mQueuedFrames(0),
+    mReady(false),
+    mHasFrame(false),
     mFrameDelay(1000000000 / framerate),
-    mLastUpdated(0)
+    mMinFrameDelay(mFrameDelay),
+    mMaxFrameDelay(minFramerate > 0 ? 1000000000 / minFramerate : mFrameDelay),
+    mLastUpdated(0),
+    mLastMotion(0),
+    mNextDeadline(0),
+    mVsyncPeriod(0),
+    mLastTimestamp(0),
+    mLastLocked(0),
+    mIntervals(0),
+    mIntervalSum(0),
+    mIntervalSquares(0),
+    mMaxInterval(0),
+    mEventFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
 {
+    mDropped.num_damage_rects = 0;
+}
+
+FrameRunner::~FrameRunner() {
+    close(mEventFd);
+}
+
+void FrameRunner::setSource(CaptureSource *source) {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    mSource = source;
 }
 
-void FrameRunner::onFrameAvailable(uint64_t frameNumber, int64_t timestamp) {
+void FrameRunner::detach() {
     std::unique_lock<std::mutex> lock(mMutex);
 
-    mPendingFrames++;
+    if (mHasFrame) {
+        mSource->release(mFrame.handle);
+        mHasFrame = false;
+    }
+    mReady = false;
+    mSource = nullptr;
+}
+
+int FrameRunner::fd() const {
+    return mEventFd;
+}
 
-    ARPFrameBuffer fb;
-    while (mPendingFrames > 1 || (mPendingFrames > 0 && (timestamp - mLastUpdated) < mFrameDelay)) {
-        if (!mLocked) {
-            int res = arpcap_acquire_frame_buffer(&fb); assert(res == 0);
-            arpcap_release_frame_buffer();
-        } else {
-            mPendingReleased++;
+double FrameRunner::framerate() {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    return 1000000000.0 / mFrameDelay;
+}
+
+void FrameRunner::onFrameAvailable(int64_t timestamp) {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    mQueuedFrames++;
+    if (mSource == nullptr) {
+        return;
+    }
+    updateFrameDelay(timestamp);
+
+    // Stale frames are dropped in one call and the newest due one is kept
+    // queued for the reader.
+    bool due = isDue(timestamp);
+    mReady = mReady || due;
+    discard(mReady ? mQueuedFrames - 1 : mQueuedFrames);
+
+    // Unless only the latest frame is wanted, the due frame is acquired
+    // right away, so it does not wait for the reader to finish converting
+    // the previous one. The frame acquired earlier is stale by now, it is
+    // released first to leave its buffer to the new one. When the reader
+    // holds every buffer we may hold, it acquires the frame in lock().
+    if (due && !mLatestOnly && mSource->holdsSeveral()) {
+        if (mHasFrame) {
+            merge_damage(&mDropped, mFrame);
+            mSource->release(mFrame.handle);
+            mHasFrame = false;
+        }
+
+        ARPFrame frame;
+        frame.version = ARP_FRAME_VERSION;
+        frame.num_damage_rects = -1;
+        if (mSource->acquire(&frame) == 0) {
+            mQueuedFrames--;
+            mReady = false;
+            mFrame = frame;
+            mHasFrame = true;
         }
-        mPendingFrames--;
     }
 
-    if (mPendingFrames > 0) {
-        mLastUpdated = timestamp;
-        mCondition.notify_one();
+    if (due) {
+        advance(timestamp);
+
+        uint64_t value = 1;
+        write(mEventFd, &value, sizeof (value));
     }
 }
 
-int FrameRunner::lock(ARPFrameBuffer *fb) {
+int FrameRunner::lock(ARPFrame *frame) {
     std::unique_lock<std::mutex> lock(mMutex);
 
-    auto pred = [this] {
-        return mPendingFrames > 0;
-    };
-    if (mCondition.wait_for(lock, std::chrono::milliseconds(10), pred)) {
-        mLocked = true;
-        arpcap_acquire_frame_buffer(fb);
-        return mPendingFrames--;;
+    if (mHasFrame) {
+        *frame = mFrame;
+        mHasFrame = false;
+    } else if (mReady) {
+        frame->version = ARP_FRAME_VERSION;
+        frame->num_damage_rects = -1;
+        if (mSource->acquire(frame) != 0) {
+            return 0;
+        }
+        mReady = false;
+        mQueuedFrames--;
     } else {
         return 0;
     }
+
+    merge_damage(frame, mDropped);
+    mDropped.num_damage_rects = 0;
+
+    if (mLastLocked > 0) {
+        double interval = (frame->fb.timestamp - mLastLocked) / 1000000.0;
+        mIntervals++;
+        mIntervalSum += interval;
+        mIntervalSquares += interval * interval;
+        mMaxInterval = std::max(mMaxInterval, interval);
+    }
+    mLastLocked = frame->fb.timestamp;
+
+    return 1;
 }
 
-void FrameRunner::release() {
+void FrameRunner::release(const ARPFrame &frame) {
     std::unique_lock<std::mutex> lock(mMutex);
 
-    if (mLocked) {
-        arpcap_release_frame_buffer();
+    mSource->release(frame.handle);
+}
+
+void FrameRunner::drop(const ARPFrame &frame) {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    merge_damage(&mDropped, frame);
+    mSource->release(frame.handle);
+}
+
+void FrameRunner::onMotion(int64_t timestamp) {
+    std::unique_lock<std::mutex> lock(mMutex);
 
-        ARPFrameBuffer fb;
-        while (mPendingReleased > 0) {
-            int res = arpcap_acquire_frame_buffer(&fb); assert(res == 0);
-            arpcap_release_frame_buffer();
-            mPendingReleased--;
+    mLastMotion = std::max(mLastMotion, timestamp);
+    mFrameDelay = mMinFrameDelay;
+    mNextDeadline = std::min(mNextDeadline, mLastUpdated + mFrameDelay);
+}
+
+void FrameRunner::logPacing() {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    if (mIntervals > 0) {
+        double mean = mIntervalSum / mIntervals;
+        double jitter = sqrt(std::max(mIntervalSquares / mIntervals - mean * mean, 0.0));
+        av_log(NULL, AV_LOG_INFO, "Frame interval %.2f ms, jitter %.2f ms, max %.2f ms, vsync %.2f ms.\n",
+               mean, jitter, mMaxInterval, mVsyncPeriod / 1000000.0);
+    }
+}
+
+// Frames are picked against a grid of deadlines one frame delay apart. A
+// frame is due from half a vsync before its deadline, which spreads the
+// dropped frames evenly when the refresh rate is not a multiple of the
+// frame rate.
+bool FrameRunner::isDue(int64_t timestamp) {
+    if (mLastTimestamp > 0 && timestamp > mLastTimestamp) {
+        // Intervals spanning skipped vsyncs are left out of the estimate.
+        int64_t interval = timestamp - mLastTimestamp;
+        if (mVsyncPeriod == 0) {
+            mVsyncPeriod = interval;
+        } else if (interval < mVsyncPeriod * 3 / 2) {
+            mVsyncPeriod += (interval - mVsyncPeriod) / 8;
         }
+    }
+    mLastTimestamp = timestamp;
+
+    return timestamp >= mNextDeadline - mVsyncPeriod / 2;
+}
 
-        mLocked = false;
+void FrameRunner::advance(int64_t timestamp) {
+    mLastUpdated = timestamp;
+    mNextDeadline += mFrameDelay;
+    if (mNextDeadline <= timestamp) {
+        // Fell behind, e.g. no frames on a static screen: restart the grid
+        // rather than catching up.
+        mNextDeadline = timestamp + mFrameDelay;
     }
 }
 
-Cap *cap_open(int top, int bottom, int width, int height, int framerate) {
-    arpcap_init();
+void FrameRunner::updateFrameDelay(int64_t timestamp) {
+    if (mMaxFrameDelay == mMinFrameDelay) {
+        return;
+    }
+    if (mLastMotion == 0) {
+        mLastMotion = timestamp;
+    }
 
-    if (width == 0 && height == 0)
+    double delay = mMinFrameDelay * exp2((double) (timestamp - mLastMotion) / ADAPTIVE_HALF_LIFE);
+    mFrameDelay = std::min(delay, (double) mMaxFrameDelay);
+}
+
+void FrameRunner::discard(int count) {
+    if (count > 0) {
+        mQueuedFrames -= mSource->discard(count);
+    }
+}
+
+int cap_pixel_format(const char *name) {
+    if (strcmp(name, "rgba") == 0) {
+        return PIXEL_FORMAT_RGBA_8888;
+    } else if (strcmp(name, "bgra") == 0) {
+        return PIXEL_FORMAT_BGRA_8888;
+    } else if (strcmp(name, "rgb565") == 0) {
+        return PIXEL_FORMAT_RGB_565;
+    }
+    return -1;
+}
+
+static void cap_release_shared() {
+    std::unique_lock<std::mutex> lock(sSharedMutex);
+
+    if (--sCaptures == 0) {
+        delete sWorkers;
+        sWorkers = nullptr;
+        arpcap_fini();
+    }
+}
+
+Cap *cap_open(const CapParam *param) {
+    int width = param->width;
+    int height = param->height;
+    int version = 0;
+
+    {
+        std::unique_lock<std::mutex> lock(sSharedMutex);
+        if (sCaptures == 0) {
+            arpcap_init();
+        }
+        version = api_version();
+        if (version < ARPCAP_API_VERSION) {
+            av_log(NULL, AV_LOG_INFO, "Capture API version %d.\n", version);
+        }
+        int threads = std::max(param->convert_threads, 1);
+        if (sWorkers == nullptr) {
+            sWorkers = new WorkerPool(threads, "convert");
+        } else if (sWorkers->size() != threads) {
+            // The pool exists only while other captures use it.
+            LOGE("Conversion threads already started with %d threads.", sWorkers->size());
+            return nullptr;
+        }
+        sCaptures++;
+    }
+
+    // With a crop the display keeps its native size and the requested size
+    // applies to the cropped region.
+    bool crop = param->crop_width > 0 && param->crop_height > 0;
+    int display_width = crop ? 0 : width;
+    int display_height = crop ? 0 : height;
+    if (display_width == 0 && display_height == 0)
     {
         ARPDisplayInfo info;
-        if (arpcap_get_display_info(&info) == 0)
+        if (get_display_info(version, param->display, &info) == 0)
         {
-            width = info.width;
-            height = info.height;
+            display_width = info.width;
+            display_height = info.height;
         }
     }
 
-    sFRunner = new FrameRunner(framerate);
+    FrameRunner *runner = new FrameRunner(param->framerate, param->min_framerate, param->latest_frame);
 
-    auto cb = [](uint64_t frameNumber, int64_t timestamp) {
-        sFRunner->onFrameAvailable(frameNumber, timestamp);
-    };
-    int res = arpcap_create(top, bottom, width, height, cb);
-    if (res != 0) {
+    ARPSessionParams params;
+    params.display = param->display;
+    params.padding_top = param->top;
+    params.padding_bottom = param->bottom;
+    params.width = display_width;
+    params.height = display_height;
+    params.format = param->pixel_format;
+
+    CaptureSource *source = CaptureSource::create(version, params, runner);
+    if (source == nullptr && params.format != PIXEL_FORMAT_NONE) {
+        LOGE("Pixel format %d not supported by display, using default.", param->pixel_format);
+        params.format = PIXEL_FORMAT_NONE;
+        source = CaptureSource::create(version, params, runner);
+    }
+    if (source == nullptr) {
         LOGE("Unable to create display.");
-        delete sFRunner;
-        sFRunner = nullptr;
-        arpcap_fini();
+        delete runner;
+        cap_release_shared();
 
         return nullptr;
     }
+    runner->setSource(source);
 
     Cap *cap = new Cap();
-    cap->pkt = nullptr;
+    cap->source = source;
+    cap->runner = runner;
+    cap->nv12 = param->nv12;
+    cap->target_width = crop ? width : display_width;
+    cap->target_height = crop ? height : display_height;
+    cap->crop_x = crop ? param->crop_x : 0;
+    cap->crop_y = crop ? param->crop_y : 0;
+    cap->crop_width = crop ? param->crop_width : 0;
+    cap->crop_height = crop ? param->crop_height : 0;
+    cap->pool = nullptr;
+    cap->nb_buffers = 0;
+    cap->workers = sWorkers;
+    cap->damage_tiles = param->damage_tiles;
+    cap->damage = false;
+    cap->tiles_x = cap->tiles_y = 0;
+    cap->hashes_valid = false;
+    cap->last = nullptr;
+    cap->dirty_tiles = cap->total_tiles = 0;
+    cap->unchanged_frames = 0;
+    cap->reported_frames = 0;
+    cap->frames = 0;
+    cap->convert_time = 0;
 
     return cap;
 }
 
+static AVBufferRef *cap_buffer_alloc(void *opaque, int size) {
+    Cap *cap = (Cap *) opaque;
+
+    if (cap->nb_buffers == CAP_BUFFERS) {
+        return nullptr;
+    }
+    cap->nb_buffers++;
+
+    return frame_buffer_alloc(size);
+}
+
+// Bytes of scratch buffer convert_rect() needs for rects of width pixels.
+static size_t convert_scratch_size(Cap *cap, const PixelFormat *pf, int width) {
+    if (pf->toI420 == nullptr) {
+        return (size_t) width * 4 * CHUNK_ROWS;
+    } else if (cap->nv12 && pf->toNV12 == nullptr) {
+        return (size_t) (width + 1) / 2 * CHUNK_ROWS;
+    }
+    return 0;
+}
+
+static int convert_rect(Cap *cap, const PixelFormat *pf, const uint8_t *src, int stride,
+                        uint8_t *data, int x, int y, int width, int height, uint8_t *scratch) {
+    if (pf->toI420 == nullptr) {
+        // A few rows at a time through ARGB, which converts directly to
+        // either layout.
+        const PixelFormat *argb = find_pixel_format(PIXEL_FORMAT_BGRA_8888);
+        for (int row = 0; row < height; row += CHUNK_ROWS) {
+            int rows = std::min(CHUNK_ROWS, height - row);
+            int res = pf->toARGB(src + row * stride, stride, scratch, width * 4, width, rows);
+            if (res >= 0) {
+                res = convert_rect(cap, argb, scratch, width * 4, data, x, y + row, width, rows, nullptr);
+            }
+            if (res < 0) {
+                return res;
+            }
+        }
+        return 0;
+    }
+
+    uint8_t *dst_y = data + cap->offset[0] + y * cap->linesize[0] + x;
+    uint8_t *dst_u = data + cap->offset[1] + y / 2 * cap->linesize[1] + (cap->nv12 ? x : x / 2);
+
+    if (!cap->nv12) {
+        uint8_t *dst_v = data + cap->offset[2] + y / 2 * cap->linesize[2] + x / 2;
+        return pf->toI420(src, stride,
+                          dst_y, cap->linesize[0],
+                          dst_u, cap->linesize[1],
+                          dst_v, cap->linesize[2],
+                          width, height);
+    }
+
+    if (pf->toNV12 != nullptr) {
+        return pf->toNV12(src, stride,
+                          dst_y, cap->linesize[0],
+                          dst_u, cap->linesize[1],
+                          width, height);
+    }
+
+    // Convert a few rows to I420 while they are in cache, writing luma in
+    // place and interleaving the chroma into the UV plane.
+    int chroma_width = (width + 1) / 2;
+    uint8_t *u = scratch;
+    uint8_t *v = u + chroma_width * CHUNK_ROWS / 2;
+    for (int row = 0; row < height; row += CHUNK_ROWS) {
+        int rows = std::min(CHUNK_ROWS, height - row);
+        int res = pf->toI420(src + row * stride, stride,
+                             dst_y + row * cap->linesize[0], cap->linesize[0],
+                             u, chroma_width,
+                             v, chroma_width,
+                             width, rows);
+        if (res < 0) {
+            return res;
+        }
+        libyuv::MergeUVPlane(u, chroma_width, v, chroma_width,
+                             dst_u + row / 2 * cap->linesize[1], cap->linesize[1],
+                             chroma_width, (rows + 1) / 2);
+    }
+
+    return 0;
+}
+
+static int convert_rows(Cap *cap, const PixelFormat *pf, const uint8_t *src, int stride,
+                        uint8_t *data, int y, int height, uint8_t *scratch) {
+    return convert_rect(cap, pf, src, stride, data, 0, y, cap->width, height, scratch);
+}
+
+// Downscales a few output rows at a time into a cache resident buffer and
+// converts them right away, so the full resolution frame is read only once
+// and only the target size is written. Each chunk is scaled with the
+// geometry of the whole frame, so the output does not depend on the chunks
+// and bands.
+static int scale_rows(Cap *cap, const PixelFormat *pf, const ARPFrameBuffer &fb, int stride,
+                      uint8_t *data, int y, int height, std::vector<uint8_t> *scratch) {
+    const PixelFormat *argb = find_pixel_format(PIXEL_FORMAT_BGRA_8888);
+    const PixelFormat *spf = pf->toARGB != nullptr ? argb : pf;
+    // The filters read up to a row past either end of the rows a chunk
+    // covers.
+    int max_src_rows = (SCALE_CHUNK_ROWS * cap->src_height + cap->height - 1) / cap->height + 3;
+    size_t scaled_size = (size_t) cap->width * 4 * SCALE_CHUNK_ROWS;
+    size_t src_size = pf->toARGB != nullptr ? (size_t) cap->src_width * 4 * max_src_rows : 0;
+    scratch->resize(scaled_size + src_size + convert_scratch_size(cap, spf, cap->width));
+    uint8_t *scaled = scratch->data();
+    uint8_t *convert_scratch = scaled + scaled_size + src_size;
+
+    for (int row = y; row < y + height; row += SCALE_CHUNK_ROWS) {
+        int rows = std::min(SCALE_CHUNK_ROWS, y + height - row);
+        const uint8_t *src = fb.data;
+        int src_stride = stride;
+        if (pf->toARGB != nullptr) {
+            int src_y = std::max(row * cap->src_height / cap->height - 1, 0);
+            int src_end = std::min(cap->src_height,
+                                   ((row + rows) * cap->src_height + cap->height - 1) / cap->height + 1);
+            uint8_t *src_argb = scaled + scaled_size;
+            src_stride = cap->src_width * 4;
+            pf->toARGB(fb.data + (size_t) src_y * stride, stride,
+                       src_argb, src_stride, cap->src_width, src_end - src_y);
+            // Addressed as the whole frame, of which only these rows are read.
+            src = src_argb - (ptrdiff_t) src_y * src_stride;
+        }
+
+        // Scaling works on any 32 bit pixel layout. The clip rect selects
+        // the rows of the chunk, which land at row in the destination.
+        int res = libyuv::ARGBScaleClip(src, src_stride, cap->src_width, cap->src_height,
+                                        scaled - (ptrdiff_t) row * cap->width * 4, cap->width * 4,
+                                        cap->width, cap->height,
+                                        0, row, cap->width, rows, libyuv::kFilterBox);
+        if (res < 0) {
+            return res;
+        }
+
+        res = convert_rows(cap, spf, scaled, cap->width * 4, data, row, rows, convert_scratch);
+        if (res < 0) {
+            return res;
+        }
+    }
+
+    return 0;
+}
+
+// The scratch buffer of a band, of at least size bytes. Buffers only grow,
+// so that converting allocates nothing once the first frames are done.
+static uint8_t *band_scratch(Cap *cap, int band, size_t size) {
+    std::vector<uint8_t> &scratch = cap->scratch[band];
+    if (scratch.size() < size) {
+        scratch.resize(size);
+    }
+    return scratch.data();
+}
+
+#ifndef NDEBUG
+// Checks that a frame scaled in bands matches the same frame scaled in one
+// band, which the chunks must not tell apart either.
+static void check_scale_bands(Cap *cap, const PixelFormat *pf, const ARPFrameBuffer &fb,
+                              const uint8_t *data) {
+    std::vector<uint8_t> single(cap->size);
+    std::vector<uint8_t> scratch;
+    if (scale_rows(cap, pf, fb, fb.stride * pf->bpp, single.data(), 0, cap->height, &scratch) < 0) {
+        return;
+    }
+
+    int chroma_height = (cap->height + 1) / 2;
+    int planes = cap->nv12 ? 2 : 3;
+    for (int plane = 0; plane < planes; plane++) {
+        int rows = plane == 0 ? cap->height : chroma_height;
+        int bytes = plane == 0 ? cap->width
+            : cap->nv12 ? cap->width + (cap->width & 1) : (cap->width + 1) / 2;
+        for (int row = 0; row < rows; row++) {
+            int offset = cap->offset[plane] + row * cap->linesize[plane];
+            if (memcmp(data + offset, single.data() + offset, bytes) != 0) {
+                LOGE("Plane %d row %d differs when scaled in %d bands.", plane, row,
+                     cap->workers->size());
+                assert(0);
+                return;
+            }
+        }
+    }
+}
+#endif
+
+static int cap_convert(Cap *cap, const PixelFormat *pf, const ARPFrameBuffer &fb, uint8_t *data) {
+    int stride = fb.stride * pf->bpp;
+
+    // Bands start on even rows so that each one owns whole chroma rows.
+    int bands = cap->workers->size();
+    int rows = ((cap->height + bands - 1) / bands + 1) & ~1;
+
+    bool scale = cap->width != cap->src_width || cap->height != cap->src_height;
+    if ((int) cap->scratch.size() < bands) {
+        cap->scratch.resize(bands);
+    }
+    size_t scratch_size = convert_scratch_size(cap, pf, cap->width);
+
+    std::atomic<int> res(0);
+    cap->workers->run(bands, [&](int band) {
+        int y = band * rows;
+        int height = std::min(rows, cap->height - y);
+        if (height <= 0) {
+            return;
+        }
+
+        int r = scale
+            ? scale_rows(cap, pf, fb, stride, data, y, height, &cap->scratch[band])
+            : convert_rows(cap, pf, fb.data + (size_t) y * stride, stride, data, y, height,
+                           band_scratch(cap, band, scratch_size));
+        if (r < 0) {
+            res = r;
+        }
+    });
+
+#ifndef NDEBUG
+    if (scale && bands > 1 && cap->frames == 0 && res == 0) {
+        check_scale_bands(cap, pf, fb, data);
+    }
+#endif
+
+    return res;
+}
+
+int cap_get_fd(Cap *cap) {
+    return cap->runner->fd();
+}
+
+// djb2 over four interleaved 32 bit lanes, so that it maps onto one SIMD
+// register.
+static void hash_bytes(const uint8_t *src, int bytes, uint32_t lanes[4]) {
+    int i = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint32x4_t h = vld1q_u32(lanes);
+    const uint32x4_t k = vdupq_n_u32(33);
+    for (; i + 16 <= bytes; i += 16) {
+        h = vmlaq_u32(vreinterpretq_u32_u8(vld1q_u8(src + i)), h, k);
+    }
+    vst1q_u32(lanes, h);
+#else
+    for (; i + 16 <= bytes; i += 16) {
+        uint32_t words[4];
+        memcpy(words, src + i, sizeof (words));
+        for (int lane = 0; lane < 4; lane++) {
+            lanes[lane] = lanes[lane] * 33 + words[lane];
+        }
+    }
+#endif
+    for (; i < bytes; i++) {
+        lanes[i & 3] = lanes[i & 3] * 33 + src[i];
+    }
+}
+
+static uint64_t hash_tile(const uint8_t *src, int stride, int bytes, int rows) {
+    uint32_t lanes[4] = { 5381, 5381, 5381, 5381 };
+    for (int row = 0; row < rows; row++) {
+        hash_bytes(src + (size_t) row * stride, bytes, lanes);
+    }
+
+    return ((uint64_t) (lanes[0] ^ lanes[2] * 31) << 32) | (lanes[1] ^ lanes[3] * 31);
+}
+
+// Hashes every tile of the frame and marks those that differ from the
+// previous frame. Returns the number of changed tiles.
+static int cap_damage(Cap *cap, const PixelFormat *pf, const ARPFrameBuffer &fb, int stride) {
+    int bands = cap->workers->size();
+    int tile_rows = (cap->tiles_y + bands - 1) / bands;
+
+    std::atomic<int> dirty(0);
+    cap->workers->run(bands, [&](int band) {
+        int count = 0;
+        int end = std::min(cap->tiles_y, (band + 1) * tile_rows);
+        for (int ty = band * tile_rows; ty < end; ty++) {
+            int y = ty * DAMAGE_TILE_SIZE;
+            int rows = std::min(DAMAGE_TILE_SIZE, cap->height - y);
+            for (int tx = 0; tx < cap->tiles_x; tx++) {
+                int x = tx * DAMAGE_TILE_SIZE;
+                int width = std::min(DAMAGE_TILE_SIZE, cap->width - x);
+                int i = ty * cap->tiles_x + tx;
+                uint64_t hash = hash_tile(fb.data + (size_t) y * stride + x * pf->bpp, stride,
+                                          width * pf->bpp, rows);
+                cap->tile_dirty[i] = !cap->hashes_valid || hash != cap->tile_hashes[i];
+                cap->tile_hashes[i] = hash;
+                count += cap->tile_dirty[i];
+            }
+        }
+        dirty += count;
+    });
+    cap->hashes_valid = true;
+
+    return dirty;
+}
+
+// Marks the tiles covered by the damage reported by the display, (x, y)
+// being the origin of the captured region in the frame. Returns the number
+// of changed tiles.
+static int cap_damage_rects(Cap *cap, const ARPFrame &frame, int x, int y) {
+    std::fill(cap->tile_dirty.begin(), cap->tile_dirty.end(), 0);
+
+    for (int i = 0; i < frame.num_damage_rects; i++) {
+        const ARPRect &rect = frame.damage_rects[i];
+        int left = std::max(rect.left - x, 0);
+        int top = std::max(rect.top - y, 0);
+        int right = std::min(rect.right - x, cap->width);
+        int bottom = std::min(rect.bottom - y, cap->height);
+        if (left >= right || top >= bottom) {
+            continue;
+        }
+
+        for (int ty = top / DAMAGE_TILE_SIZE; ty <= (bottom - 1) / DAMAGE_TILE_SIZE; ty++) {
+            for (int tx = left / DAMAGE_TILE_SIZE; tx <= (right - 1) / DAMAGE_TILE_SIZE; tx++) {
+                cap->tile_dirty[ty * cap->tiles_x + tx] = 1;
+            }
+        }
+    }
+
+    // The hashes of the tiles were not updated.
+    cap->hashes_valid = false;
+
+    return std::count(cap->tile_dirty.begin(), cap->tile_dirty.end(), 1);
+}
+
+static void copy_rect(Cap *cap, const uint8_t *src, uint8_t *dst,
+                      int x, int y, int width, int height) {
+    int offset = cap->offset[0] + y * cap->linesize[0] + x;
+    libyuv::CopyPlane(src + offset, cap->linesize[0], dst + offset, cap->linesize[0],
+                      width, height);
+
+    int planes = cap->nv12 ? 2 : 3;
+    int chroma_x = cap->nv12 ? x : x / 2;
+    int chroma_width = cap->nv12 ? (width + 1) & ~1 : (width + 1) / 2;
+    for (int plane = 1; plane < planes; plane++) {
+        offset = cap->offset[plane] + y / 2 * cap->linesize[plane] + chroma_x;
+        libyuv::CopyPlane(src + offset, cap->linesize[plane], dst + offset, cap->linesize[plane],
+                          chroma_width, (height + 1) / 2);
+    }
+}
+
+// Converts the changed tiles and copies the others from the previous output,
+// merging runs of tiles in the same state.
+static int cap_convert_damage(Cap *cap, const PixelFormat *pf, const ARPFrameBuffer &fb,
+                              int stride, uint8_t *data) {
+    int bands = cap->workers->size();
+    int tile_rows = (cap->tiles_y + bands - 1) / bands;
+    if ((int) cap->scratch.size() < bands) {
+        cap->scratch.resize(bands);
+    }
+    size_t scratch_size = convert_scratch_size(cap, pf, cap->width);
+
+    std::atomic<int> res(0);
+    cap->workers->run(bands, [&](int band) {
+        uint8_t *scratch = band_scratch(cap, band, scratch_size);
+        int end = std::min(cap->tiles_y, (band + 1) * tile_rows);
+        for (int ty = band * tile_rows; ty < end; ty++) {
+            const uint8_t *dirty = &cap->tile_dirty[ty * cap->tiles_x];
+            int y = ty * DAMAGE_TILE_SIZE;
+            int rows = std::min(DAMAGE_TILE_SIZE, cap->height - y);
+            for (int tx = 0; tx < cap->tiles_x;) {
+                int next = tx + 1;
+                while (next < cap->tiles_x && dirty[next] == dirty[tx]) {
+                    next++;
+                }
+
+                int x = tx * DAMAGE_TILE_SIZE;
+                int width = std::min(next * DAMAGE_TILE_SIZE, cap->width) - x;
+                if (dirty[tx]) {
+                    int r = convert_rect(cap, pf, fb.data + (size_t) y * stride + x * pf->bpp,
+                                         stride, data, x, y, width, rows, scratch);
+                    if (r < 0) {
+                        res = r;
+                    }
+                } else {
+                    copy_rect(cap, cap->last->data, data, x, y, width, rows);
+                }
+                tx = next;
+            }
+        }
+    });
+
+    return res;
+}
+
+// Sizes the output and its buffer pool for src_width x src_height frames,
+// on the first frame and whenever the display is resized or rotated.
+static void cap_setup(Cap *cap, int src_width, int src_height) {
+    if (cap->pool != nullptr) {
+        LOGE("Frame size changed from %dx%d to %dx%d.",
+             cap->src_width, cap->src_height, src_width, src_height);
+        // Buffers still referenced downstream outlive their pool.
+        av_buffer_pool_uninit(&cap->pool);
+        av_buffer_unref(&cap->last);
+    }
+
+    // The target size follows the orientation of the display.
+    if ((src_width > src_height) != (cap->target_width > cap->target_height)) {
+        std::swap(cap->target_width, cap->target_height);
+    }
+
+    int width = src_width;
+    int height = src_height;
+    if (cap->target_width > 0 && cap->target_height > 0 &&
+        (width > cap->target_width || height > cap->target_height)) {
+        width = cap->target_width;
+        height = cap->target_height;
+    }
+    cap->src_width = src_width;
+    cap->src_height = src_height;
+    cap->width = width;
+    cap->height = height;
+    // Rows start on cache lines, the layout of av_image_fill_arrays() with
+    // FRAME_ALIGN.
+    int chroma_height = (height + 1) / 2;
+    cap->offset[0] = 0;
+    cap->linesize[0] = FFALIGN(width, FRAME_ALIGN);
+    cap->offset[1] = cap->offset[0] + cap->linesize[0] * height;
+    if (cap->nv12) {
+        cap->linesize[1] = FFALIGN(width + (width & 1), FRAME_ALIGN);
+        cap->offset[2] = 0;
+        cap->linesize[2] = 0;
+        cap->size = cap->offset[1] + cap->linesize[1] * chroma_height;
+    } else {
+        cap->linesize[1] = cap->linesize[2] = FFALIGN((width + 1) / 2, FRAME_ALIGN);
+        cap->offset[2] = cap->offset[1] + cap->linesize[1] * chroma_height;
+        cap->size = cap->offset[2] + cap->linesize[2] * chroma_height;
+    }
+    cap->nb_buffers = 0;
+    cap->pool = av_buffer_pool_init2(cap->size, cap, cap_buffer_alloc, nullptr);
+
+    cap->damage = cap->damage_tiles;
+    if (cap->damage && (width != src_width || height != src_height)) {
+        LOGE("Damage tracking is not supported when downscaling, disabled.");
+        cap->damage = false;
+    }
+    if (cap->damage) {
+        cap->tiles_x = (width + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+        cap->tiles_y = (height + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+        cap->tile_hashes.resize(cap->tiles_x * cap->tiles_y);
+        cap->tile_dirty.resize(cap->tiles_x * cap->tiles_y);
+        cap->hashes_valid = false;
+    }
+}
+
+// Tells downstream how the picture lies in the packet and when it was captured.
+static void cap_describe(Cap *cap, AVPacket *pkt, const ARPFrameBuffer &fb) {
+    PktFrame *desc = (PktFrame *) av_packet_new_side_data(pkt, PKT_DATA_FRAME, sizeof (PktFrame));
+    if (desc == nullptr) {
+        return;
+    }
+    memset(desc, 0, sizeof (PktFrame));
+    desc->width = cap->width;
+    desc->height = cap->height;
+    desc->format = cap->nv12 ? AV_PIX_FMT_NV12 : AV_PIX_FMT_YUV420P;
+    for (int i = 0; i < 3 && cap->linesize[i] > 0; i++) {
+        desc->linesize[i] = cap->linesize[i];
+        desc->offset[i] = cap->offset[i];
+    }
+    desc->timestamp = fb.timestamp;
+    desc->frame_number = fb.frame_number;
+}
+
 int cap_read(Cap *cap, AVPacket *pkt) {
-    ARPFrameBuffer fb;
-    if (sFRunner->lock(&fb) == 0) {
+    ARPFrame frame;
+    if (cap->runner->lock(&frame) == 0) {
+        return AVERROR(EAGAIN);
+    }
+    const PixelFormat *pf = find_pixel_format(frame.fb.format);
+    if (pf == nullptr) {
+        LOGE("Unsupported pixel format %d.", frame.fb.format);
+        cap->runner->release(frame);
+        return -1;
+    }
+
+    // Cropping only moves the start of the source, rows keep the frame stride.
+    // Frames too small to hold a 2x2 region are captured whole.
+    ARPFrameBuffer fb = frame.fb;
+    uint32_t x = 0;
+    uint32_t y = 0;
+    if (cap->crop_width > 0 && fb.width >= 2 && fb.height >= 2) {
+        x = std::min<uint32_t>(cap->crop_x, fb.width - 2);
+        y = std::min<uint32_t>(cap->crop_y, fb.height - 2);
+        fb.data += ((size_t) y * fb.stride + x) * pf->bpp;
+        fb.width = std::min<uint32_t>(cap->crop_width, fb.width - x) & ~1;
+        fb.height = std::min<uint32_t>(cap->crop_height, fb.height - y) & ~1;
+    }
+
+    if (cap->pool == nullptr || (int) fb.width != cap->src_width || (int) fb.height != cap->src_height) {
+        cap_setup(cap, fb.width, fb.height);
+    }
+
+    AVBufferRef *buf = av_buffer_pool_get(cap->pool);
+    if (buf == nullptr) {
+        // Every buffer of the ring is still referenced downstream.
+        cap->runner->drop(frame);
         return AVERROR(EAGAIN);
     }
 
-    if (cap->pkt == nullptr) {
-        int width = fb.width;
-        int height = fb.height;
-        cap->width = width;
-        cap->height = height;
-        cap->pkt = av_packet_alloc();
-        av_new_packet(cap->pkt, width * height * 3 / 2);
-        cap->data[0] = cap->pkt->data;
-        cap->data[1] = cap->data[0] + width * height;
-        cap->data[2] = cap->data[1] + width * height / 4;
-        cap->linesize[0] = width;
-        cap->linesize[1] = cap->linesize[2] = width / 2;
-    }
-
-    int res = libyuv::ABGRToI420(
-            (uint8_t *)fb.data,
-            fb.stride * RGBA_BPP,
-            cap->data[0],
-            cap->linesize[0],
-            cap->data[1],
-            cap->linesize[1],
-            cap->data[2],
-            cap->linesize[2],
-            cap->width,
-            cap->height);
+    int64_t start = av_gettime_relative();
+    int res;
+    if (cap->damage) {
+        int stride = fb.stride * pf->bpp;
+        int tiles = cap->tiles_x * cap->tiles_y;
+        int dirty;
+        if (frame.num_damage_rects >= 0 && cap->last != nullptr) {
+            dirty = cap_damage_rects(cap, frame, x, y);
+            cap->reported_frames++;
+        } else {
+            dirty = cap_damage(cap, pf, fb, stride);
+        }
+        cap->dirty_tiles += dirty;
+        if (dirty > 0) {
+            cap->runner->onMotion(frame.fb.timestamp);
+        }
+        cap->total_tiles += tiles;
+        av_log(NULL, AV_LOG_DEBUG, "Frame %d: %d of %d tiles changed.\n",
+               cap->frames, dirty, tiles);
+
+        if (dirty == 0) {
+            // Nothing changed, hand out the previous picture flagged as such.
+            av_buffer_unref(&buf);
+            cap->runner->release(frame);
+
+            cap->convert_time += av_gettime_relative() - start;
+            cap->frames++;
+            cap->unchanged_frames++;
+
+            pkt->buf = av_buffer_ref(cap->last);
+            pkt->data = pkt->buf->data;
+            pkt->size = cap->size;
+            pkt->flags |= PKT_FLAG_UNCHANGED;
+            pkt->stream_index = AVMEDIA_TYPE_VIDEO;
+            cap_describe(cap, pkt, frame.fb);
+
+            return 0;
+        }
+
+        res = cap_convert_damage(cap, pf, fb, stride, buf->data);
+    } else {
+        res = cap_convert(cap, pf, fb, buf->data);
+    }
     if (res < 0) {
         LOGE("Unable to convert frame to yuv.");
-        sFRunner->release();
+        av_buffer_unref(&buf);
+        // The previous output no longer matches the hashes, the next frame
+        // is converted whole, with the damage of this one.
+        cap->hashes_valid = false;
+        cap->runner->drop(frame);
         return -1;
     }
 
-    sFRunner->release();
+    cap->runner->release(frame);
+
+    cap->convert_time += av_gettime_relative() - start;
+    cap->frames++;
+
+    if (cap->damage) {
+        av_buffer_unref(&cap->last);
+        cap->last = av_buffer_ref(buf);
 
-    av_packet_ref(pkt, cap->pkt);
+        int tiles = cap->tiles_x * cap->tiles_y;
+        PktDamage *damage = (PktDamage *) av_packet_new_side_data(
+                pkt, PKT_DATA_DAMAGE, sizeof (PktDamage) + tiles);
+        if (damage != nullptr) {
+            damage->tile_size = DAMAGE_TILE_SIZE;
+            damage->tiles_x = cap->tiles_x;
+            damage->tiles_y = cap->tiles_y;
+            memcpy(damage + 1, cap->tile_dirty.data(), tiles);
+        }
+    }
+
+    pkt->buf = buf;
+    pkt->data = buf->data;
+    pkt->size = cap->size;
     pkt->stream_index = AVMEDIA_TYPE_VIDEO;
-    PKT_MKSIZE(pkt, cap->width, cap->height);
+    cap_describe(cap, pkt, frame.fb);
 
     return 0;
 }
 
+double cap_get_framerate(Cap *cap) {
+    return cap->runner->framerate();
+}
+
 int cap_close(Cap *cap) {
-    arpcap_destroy();
+    cap->runner->detach();
+    delete cap->source;
 
-    if (cap->pkt != nullptr)
+    av_buffer_unref(&cap->last);
+    if (cap->pool != nullptr)
     {
-        av_packet_free(&cap->pkt);
+        av_buffer_pool_uninit(&cap->pool);
     }
+    cap->runner->logPacing();
+    if (cap->frames > 0)
+    {
+        av_log(NULL, AV_LOG_INFO, "Converted %d frames, %.3f ms/frame with %d threads.\n",
+               cap->frames, cap->convert_time / 1000.0 / cap->frames, cap->workers->size());
+    }
+    if (cap->total_tiles > 0)
+    {
+        av_log(NULL, AV_LOG_INFO, "Damage tracking: %.1f%% of tiles converted, %d of %d frames unchanged, "
+               "%d with display damage.\n", cap->dirty_tiles * 100.0 / cap->total_tiles,
+               cap->unchanged_frames, cap->frames, cap->reported_frames);
+    }
+    delete cap->runner;
     delete cap;
 
-    delete sFRunner;
-    sFRunner = nullptr;
-
-    arpcap_fini();
+    cap_release_shared();
 
     return 0;
 }
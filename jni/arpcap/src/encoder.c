@@ -0,0 +1,70 @@
+/*
+ * Copyright 2018 ARP Network
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <encoder.h>
+
+#include <libavutil/common.h>
+#include <libavutil/log.h>
+
+#include <sched.h>
+
+// Macroblock rows per slice below which sliced threads stop paying off.
+// x264 goes down to 4 rows.
+#define MIN_SLICE_ROWS 8
+#define MAX_THREADS    16
+
+void encoder_threads_resolve(const EncoderThreads *threads, uint64_t cpus,
+                             int width, int height, EncoderThreads *resolved)
+{
+  *resolved = *threads;
+  if (threads->threads != ENCODER_THREADS_AUTO)
+  {
+    // The default, threads 0 and THREAD_TYPE_DEFAULT, is left to x264 by
+    // both filters: a thread per CPU of its affinity mask with the sliced
+    // threads of zerolatency, down to 4 rows per slice.
+    return;
+  }
+
+  // The same count as x264, the encoder is opened with the encoder CPUs.
+  int cores = av_popcount64(cpus);
+  if (cores == 0)
+  {
+    cpu_set_t set;
+    cores = sched_getaffinity(0, sizeof (set), &set) == 0 ? CPU_COUNT(&set) : 1;
+  }
+  int rows = (height + 15) / 16;
+
+  // Slices keep the latency of a single thread. Unlike x264, stop at
+  // slices of MIN_SLICE_ROWS rows, past which the compression loss
+  // outweighs the speedup.
+  resolved->threads = av_clip(FFMIN(cores, rows / MIN_SLICE_ROWS), 1, MAX_THREADS);
+  if (resolved->type == THREAD_TYPE_DEFAULT)
+  {
+    resolved->type = THREAD_TYPE_SLICE;
+  }
+  if (resolved->type == THREAD_TYPE_FRAME)
+  {
+    // x264 starts 1.5 frame threads per CPU, each one adds a frame of
+    // latency.
+    resolved->threads = av_clip(cores, 1, MAX_THREADS);
+  }
+
+  av_log(NULL, AV_LOG_INFO, "Encoding %dx%d with %d %s threads on %d CPUs.\n",
+         width, height, resolved->threads,
+         resolved->type == THREAD_TYPE_FRAME ? "frame" : "slice", cores);
+}
@@ -38,6 +38,7 @@ void filter_register_all()
   REGISTER_FILTER(repeat);
   REGISTER_FILTER(stat);
   REGISTER_FILTER(tcp);
+  REGISTER_FILTER(x264);
 }
 
 Filter *find_filter(const char *name)
@@ -14,30 +14,77 @@
  * limitations under the License.
  */
 
+#include <encoder.h>
 #include <transcode.h>
+#include <utils.h>
 
+#include <libavutil/fifo.h>
 #include <libavutil/opt.h>
+#include <libavutil/time.h>
 
 #include <assert.h>
 
 typedef struct {
   AVCodecContext *codec;
+  // Encoder of the previous frame size, kept to switch back at once when
+  // the display is rotated back.
+  AVCodecContext *spare;
   int64_t next_pts;
+  int new_extradata;
+
+  // Packets received and not emitted yet, one goes out per call. With frame
+  // threads or a lookahead the encoder holds frames back and outputs them in
+  // bursts.
+  AVFifoBuffer *queue;
+  // Frames sent to the encoder whose packet has not been received.
+  int pending;
+
+  // Time spent in the encoder per frame, sending it and receiving its packet.
+  int frames;
+  int64_t encode_time;
+  int64_t max_encode_time;
 } AVContext;
 
+static AVCodecContext *start_encoder(TranscodeContext *ctx, int width, int height);
 static AVCodecContext *open_encoder(
     int type, TranscodeParam *param, int width, int height);
 static AVCodecContext *open_h264_encoder(
     int width, int height, TranscodeParam *param, int fmp4);
+static void switch_encoder(TranscodeContext *ctx, AVContext *av, AVFrame *frame);
+static int receive_packets(TranscodeContext *ctx, AVContext *av);
+static void drain_encoder(TranscodeContext *ctx, AVContext *av);
+static int next_packet(AVContext *av, AVPacket *pkt);
+
+static int av_init(TranscodeContext *ctx, int type)
+{
+  (void) type;
+
+  AVContext *av = (AVContext *) ctx->priv_data;
+  av->queue = av_fifo_alloc(8 * sizeof (AVPacket *));
+
+  return av->queue != NULL ? 0 : AVERROR(ENOMEM);
+}
 
 static int av_fini(TranscodeContext *ctx)
 {
   AVContext *av = (AVContext *) ctx->priv_data;
 
-  if (av->codec != NULL)
+  if (av->frames > 0)
+  {
+    av_log(NULL, AV_LOG_INFO, "Encoded %d frames with av, %.3f ms/frame, max %.3f ms.\n",
+           av->frames, av->encode_time / 1000.0 / av->frames, av->max_encode_time / 1000.0);
+  }
+
+  avcodec_free_context(&av->codec);
+  avcodec_free_context(&av->spare);
+
+  AVPacket *queued = NULL;
+  while (av->queue != NULL && av_fifo_size(av->queue) > 0)
   {
-    avcodec_close(av->codec);
+    av_fifo_generic_read(av->queue, &queued, sizeof (queued), NULL);
+    av_packet_free(&queued);
   }
+  av_fifo_freep(&av->queue);
 
   return 0;
 }
@@ -46,48 +93,182 @@ static int av_apply(TranscodeContext *ctx, AVPacket *pkt)
 {
   AVContext *av = (AVContext *) ctx->priv_data;
 
-  if (pkt == NULL || pkt->data == NULL) return AVERROR(EAGAIN);
+  if (pkt == NULL) return AVERROR(EAGAIN);
+  // No new picture, the packets held back go out.
+  if (pkt->data == NULL) return next_packet(av, pkt);
 
   AVFrame *frame = av_frame_alloc();
-  new_frame_from_packet(frame, pkt);
+  int ret = new_frame_from_packet(frame, pkt);
+  if (ret < 0)
+  {
+    av_frame_free(&frame);
+    return ret;
+  }
 
-  if (av->codec == NULL)
+  if (av->codec == NULL ||
+      av->codec->width != frame->width || av->codec->height != frame->height)
   {
-    av->codec = open_encoder(ctx->type, &ctx->param, frame->width, frame->height);
-    assert(av->codec != NULL);
-    av->next_pts = 0;
+    switch_encoder(ctx, av, frame);
   }
 
   frame->pts = av->next_pts;
-  int ret = avcodec_send_frame(av->codec, frame);
+  av->next_pts += 1000;
+  int64_t start = av_gettime_relative();
+  ret = avcodec_send_frame(av->codec, frame);
   if (ret >= 0)
   {
-    ret = avcodec_receive_packet(av->codec, pkt);
-    if (ret >= 0)
+    av->pending++;
+    ret = receive_packets(ctx, av);
+
+    int64_t elapsed = av_gettime_relative() - start;
+    av->frames++;
+    av->encode_time += elapsed;
+    av->max_encode_time = FFMAX(av->max_encode_time, elapsed);
+  }
+
+  av_frame_free(&frame);
+  if (ret < 0)
+  {
+    return ret;
+  }
+
+  return next_packet(av, pkt);
+}
+
+// Sends the frames still in the encoder through the filters that follow,
+// on shutdown.
+static int av_flush(TranscodeContext *ctx, AVPacket *pkt)
+{
+  AVContext *av = (AVContext *) ctx->priv_data;
+
+  if (av->codec != NULL && av->pending > 0)
+  {
+    drain_encoder(ctx, av);
+  }
+
+  int ret = next_packet(av, pkt);
+  return ret == AVERROR(EAGAIN) ? AVERROR_EOF : ret;
+}
+
+// Queues all the packets the encoder has ready.
+int receive_packets(TranscodeContext *ctx, AVContext *av)
+{
+  AVCodecContext *codec = av->codec;
+
+  while (1)
+  {
+    AVPacket *out = av_packet_alloc();
+    int ret = out != NULL ? avcodec_receive_packet(codec, out) : AVERROR(ENOMEM);
+    if (ret < 0)
+    {
+      av_packet_free(&out);
+      return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+    }
+    av->pending--;
+
+    out->stream_index = ctx->type;
+    if (out->duration == 0)
+    {
+      out->duration = 1000;
+    }
+
+    if (av->new_extradata && codec->extradata_size > 0)
+    {
+      fprintf(stderr, "Found %d bytes extradata.\n", codec->extradata_size);
+      uint8_t *extradata = av_packet_new_side_data(out,
+                                                  AV_PKT_DATA_NEW_EXTRADATA,
+                                                  codec->extradata_size);
+      memcpy(extradata, codec->extradata, codec->extradata_size);
+    }
+    av->new_extradata = 0;
+
+    if (av_fifo_space(av->queue) < (int) sizeof (out) &&
+        av_fifo_grow(av->queue, av_fifo_size(av->queue)) < 0)
     {
-      pkt->stream_index = ctx->type;
-      PKT_MKSIZE(pkt, frame->width, frame->height);
-      if (pkt->duration == 0)
-      {
-        pkt->duration = 1000;
-      }
-
-      if (av->next_pts == 0 && av->codec->extradata_size > 0)
-      {
-        fprintf(stderr, "Found %d bytes extradata.\n", av->codec->extradata_size);
-        uint8_t *extradata = av_packet_new_side_data(pkt,
-                                                    AV_PKT_DATA_NEW_EXTRADATA,
-                                                    av->codec->extradata_size);
-        memcpy(extradata, av->codec->extradata, av->codec->extradata_size);
-      }
-
-      av->next_pts += (pkt->duration > 0) ? pkt->duration : 1000;
+      av_packet_free(&out);
+      return AVERROR(ENOMEM);
     }
+    av_fifo_generic_write(av->queue, &out, sizeof (out), NULL);
   }
+}
 
-  av_frame_free(&frame);
+// Queues the frames in flight and frees the encoder, which takes no more
+// frames once drained.
+void drain_encoder(TranscodeContext *ctx, AVContext *av)
+{
+  if (avcodec_send_frame(av->codec, NULL) >= 0)
+  {
+    receive_packets(ctx, av);
+  }
+  if (av->pending > 0)
+  {
+    av_log(NULL, AV_LOG_WARNING, "Lost %d frames draining the encoder.\n", av->pending);
+  }
+  av->pending = 0;
+  avcodec_free_context(&av->codec);
+}
+
+int next_packet(AVContext *av, AVPacket *pkt)
+{
+  if (av_fifo_size(av->queue) == 0)
+  {
+    return AVERROR(EAGAIN);
+  }
+
+  AVPacket *queued = NULL;
+  av_fifo_generic_read(av->queue, &queued, sizeof (queued), NULL);
+  av_packet_move_ref(pkt, queued);
+  av_packet_free(&queued);
+
+  return 0;
+}
+
+// Makes the encoder match the frame size. The encoder being replaced becomes
+// the spare, so that rotating back only takes an IDR frame.
+void switch_encoder(TranscodeContext *ctx, AVContext *av, AVFrame *frame)
+{
+  int64_t start = av_gettime_relative();
+
+  AVCodecContext *codec = av->spare;
+  if (codec != NULL && codec->width == frame->width && codec->height == frame->height)
+  {
+    // The references of the spare are stale.
+    frame->pict_type = AV_PICTURE_TYPE_I;
+  }
+  else
+  {
+    avcodec_free_context(&codec);
+    codec = start_encoder(ctx, frame->width, frame->height);
+    assert(codec != NULL);
+  }
+
+  if (av->codec != NULL)
+  {
+    av_log(NULL, AV_LOG_INFO, "Switched encoder from %dx%d to %dx%d in %.1f ms.\n",
+           av->codec->width, av->codec->height, frame->width, frame->height,
+           (av_gettime_relative() - start) / 1000.0);
+  }
+  // Frames in flight come out before the first one of the new size. A
+  // drained encoder is not kept as the spare.
+  if (av->codec != NULL && av->pending > 0)
+  {
+    drain_encoder(ctx, av);
+  }
+  av->spare = av->codec;
+  av->codec = codec;
+  av->new_extradata = 1;
+}
+
+AVCodecContext *start_encoder(TranscodeContext *ctx, int width, int height)
+{
+  TranscodeParam *param = &ctx->param;
 
-  return ret;
+  ThreadSwitch saved;
+  thread_switch_encoder(&saved, &param->encoder_policy, &param->capture_policy);
+  AVCodecContext *codec = open_encoder(ctx->type, param, width, height);
+  thread_switch_back(&saved);
+
+  return codec;
 }
 
 AVCodecContext *open_encoder(int type, TranscodeParam *param, int width, int height)
@@ -113,14 +294,15 @@ AVCodecContext *open_h264_encoder(
 
   ctx->width = width;
   ctx->height = height;
-  ctx->gop_size = 100;
+  ctx->gop_size = param->gop;
   ctx->max_b_frames = 0;
   if (param->bitrate > 0)
   {
     ctx->rc_buffer_size = param->bitrate * 1000;
     ctx->rc_max_rate = param->bitrate * 1000;
   }
-  ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  // NV12 is x264's internal layout, it is used without repacking chroma.
+  ctx->pix_fmt = param->nv12 ? AV_PIX_FMT_NV12 : AV_PIX_FMT_YUV420P;
   if (fmp4)
   {
     ctx->framerate = av_make_q(1, param->framerate + 1);
@@ -141,6 +323,12 @@ AVCodecContext *open_h264_encoder(
   av_opt_set(ctx->priv_data, "level", "5.2", 0);
   av_opt_set(ctx->priv_data, "preset", param->preset, 0);
   av_opt_set(ctx->priv_data, "tune", "zerolatency", 0);
+  // Frames forced to I, when resuming the spare encoder, are IDR frames.
+  av_opt_set(ctx->priv_data, "forced-idr", "1", 0);
+  if (param->intra_refresh && !fmp4)
+  {
+    av_opt_set(ctx->priv_data, "intra-refresh", "1", 0);
+  }
   if (param->crf > 0)
   {
     char crf[BUFSIZ];
@@ -148,6 +336,29 @@ AVCodecContext *open_h264_encoder(
     av_opt_set(ctx->priv_data, "crf", crf, 0);
   }
 
+  EncoderThreads threads;
+  encoder_threads_resolve(&param->encoder_threads, param->encoder_policy.cpus,
+                          width, height, &threads);
+  // libx264 passes the count on as is, 0 being its default of
+  // X264_THREADS_AUTO. It only touches b_sliced_threads for a nonzero
+  // thread type, its default of 0 keeps the tune's sliced threads.
+  ctx->thread_count = threads.threads;
+  ctx->thread_type = 0;
+  if (threads.type != THREAD_TYPE_DEFAULT)
+  {
+    ctx->thread_type = threads.type == THREAD_TYPE_SLICE ? FF_THREAD_SLICE : FF_THREAD_FRAME;
+  }
+  if (threads.lookahead >= 0)
+  {
+    av_opt_set_int(ctx->priv_data, "rc-lookahead", threads.lookahead, 0);
+  }
+  if (threads.sync_lookahead >= 0)
+  {
+    char params[BUFSIZ];
+    snprintf(params, BUFSIZ, "sync-lookahead=%d", threads.sync_lookahead);
+    av_opt_set(ctx->priv_data, "x264-params", params, 0);
+  }
+
   ret = avcodec_open2(ctx, codec, NULL); assert(ret >= 0);
 
   return ctx;
@@ -156,7 +367,8 @@ AVCodecContext *open_h264_encoder(
 Filter av_filter = {
   .name = "av",
   .priv_data_size = sizeof (AVContext),
-  .init = NULL,
+  .init = av_init,
   .fini = av_fini,
-  .apply = av_apply
+  .apply = av_apply,
+  .flush = av_flush
 };
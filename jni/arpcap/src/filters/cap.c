@@ -36,17 +36,38 @@ static int cap_init(TranscodeContext *ctx, int type)
 
   CapContext *cap = (CapContext *) ctx->priv_data;
 
-  cap->cap = cap_open(
-    ctx->param.top, ctx->param.bottom,
-    ctx->param.width, ctx->param.height, ctx->param.framerate);
+  CapParam param = {
+    .display = ctx->param.display,
+    .top = ctx->param.top,
+    .bottom = ctx->param.bottom,
+    .width = ctx->param.width,
+    .height = ctx->param.height,
+    .framerate = ctx->param.framerate,
+    .min_framerate = ctx->param.min_framerate,
+    .latest_frame = ctx->param.latest_frame,
+    .convert_threads = ctx->param.convert_threads,
+    .pixel_format = ctx->param.pixel_format,
+    .nv12 = ctx->param.nv12,
+    .crop_x = ctx->param.crop_x,
+    .crop_y = ctx->param.crop_y,
+    .crop_width = ctx->param.crop_width,
+    .crop_height = ctx->param.crop_height,
+    .damage_tiles = ctx->param.damage_tiles
+  };
+  cap->cap = cap_open(&param);
+  if (cap->cap == NULL)
+  {
+    return -1;
+  }
 
-  return 0;
+  return loop_add(ctx->loop, cap_get_fd(cap->cap));
 }
 
 static int cap_fini(TranscodeContext *ctx)
 {
   CapContext *cap = (CapContext *) ctx->priv_data;
 
+  loop_remove(ctx->loop, cap_get_fd(cap->cap));
   cap_close(cap->cap);
 
   return 0;
@@ -57,7 +78,10 @@ static int cap_apply(TranscodeContext *ctx, AVPacket *pkt)
   assert(pkt != NULL && pkt->data == NULL);
 
   CapContext *cap = (CapContext *) ctx->priv_data;
-  return cap_read(cap->cap, pkt);
+  int ret = cap_read(cap->cap, pkt);
+  ctx->capture_rate = cap_get_framerate(cap->cap);
+
+  return ret;
 }
 
 Filter cap_filter = {
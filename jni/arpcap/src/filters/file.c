@@ -19,17 +19,23 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <string.h>
 #include <unistd.h>
 
+// Outputs writing to the same path share its fd.
+#define MAX_FILES 8
+
 typedef struct {
+  char path[PATH_MAX];
   int fd;
   int ref;
 } FileRef;
 
 static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static FileRef file_ref = { -1, 0 };
+static FileRef file_refs[MAX_FILES];
 
+static FileRef *file_ref_get(const char *path);
 static ssize_t write_fully(int fd, const void *buf, size_t nbyte);
 
 static int file_init(TranscodeContext *ctx, int type)
@@ -43,12 +49,14 @@ static int file_init(TranscodeContext *ctx, int type)
   sscanf(ctx->output, "file://%s", path);
 
   pthread_mutex_lock(&file_mutex);
-  if (file_ref.fd == -1)
+  FileRef *ref = file_ref_get(path); assert(ref != NULL);
+  if (ref->ref == 0)
   {
-    file_ref.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC); assert(file_ref.fd >= 0);
+    ref->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC); assert(ref->fd >= 0);
+    strcpy(ref->path, path);
   }
-  file->fd = file_ref.fd;
-  file_ref.ref++;
+  file->fd = ref->fd;
+  ref->ref++;
   pthread_mutex_unlock(&file_mutex);
 
   return 0;
@@ -59,18 +67,41 @@ static int file_fini(TranscodeContext *ctx)
   FileContext *file = (FileContext *) ctx->priv_data;
 
   pthread_mutex_lock(&file_mutex);
-  file->fd = -1;
-  file_ref.ref--;
-  if (file_ref.ref == 0)
+  for (int i = 0; i < MAX_FILES; i++)
   {
-    close(file_ref.fd);
-    file_ref.fd = -1;
+    FileRef *ref = &file_refs[i];
+    if (ref->ref > 0 && ref->fd == file->fd && --ref->ref == 0)
+    {
+      close(ref->fd);
+      ref->fd = -1;
+    }
   }
+  file->fd = -1;
   pthread_mutex_unlock(&file_mutex);
 
   return 0;
 }
 
+// The entry of path, or a free one.
+FileRef *file_ref_get(const char *path)
+{
+  FileRef *free_ref = NULL;
+  for (int i = 0; i < MAX_FILES; i++)
+  {
+    FileRef *ref = &file_refs[i];
+    if (ref->ref > 0 && strcmp(ref->path, path) == 0)
+    {
+      return ref;
+    }
+    if (ref->ref == 0 && free_ref == NULL)
+    {
+      free_ref = ref;
+    }
+  }
+
+  return free_ref;
+}
+
 static int file_apply(TranscodeContext *ctx, AVPacket *pkt)
 {
   FileContext *file = (FileContext *) ctx->priv_data;
@@ -15,10 +15,12 @@
  */
 
 #include <transcode.h>
+#include <utils.h>
 
 #include <libavutil/time.h>
 
 #include <assert.h>
+#include <unistd.h>
 
 #define REPEAT_INTERVAL 80000
 
@@ -27,6 +29,7 @@ typedef struct {
 
   int64_t interval;
   int64_t last_ts;
+  int timer;
 } RepeatContext;
 
 static int repeat_init(TranscodeContext *ctx, int type)
@@ -36,8 +39,9 @@ static int repeat_init(TranscodeContext *ctx, int type)
   RepeatContext *repeat = (RepeatContext *) ctx->priv_data;
   repeat->pkt = av_packet_alloc();
   repeat->interval = FFMAX(1000000 / ctx->param.framerate * 2, REPEAT_INTERVAL);
+  repeat->timer = loop_timer_create(); assert(repeat->timer >= 0);
 
-  return 0;
+  return loop_add(ctx->loop, repeat->timer);
 }
 
 static int repeat_fini(TranscodeContext *ctx)
@@ -45,6 +49,8 @@ static int repeat_fini(TranscodeContext *ctx)
   RepeatContext *repeat = (RepeatContext *) ctx->priv_data;
 
   av_packet_free(&repeat->pkt);
+  loop_remove(ctx->loop, repeat->timer);
+  close(repeat->timer);
 
   return 0;
 }
@@ -53,13 +59,20 @@ static int repeat_apply(TranscodeContext *ctx, AVPacket *pkt)
 {
   RepeatContext *repeat = (RepeatContext *) ctx->priv_data;
 
-  int64_t now = av_gettime();
+  int64_t now = av_gettime_relative();
+  if (pkt != NULL && (pkt->flags & PKT_FLAG_UNCHANGED))
+  {
+    // Same picture as the stored one, only repeat it when due.
+    av_packet_unref(pkt);
+  }
+
   if (pkt != NULL && pkt->data != NULL)
   {
     if (repeat->pkt->data != NULL) av_packet_unref(repeat->pkt);
 
     av_packet_ref(repeat->pkt, pkt);
     repeat->last_ts = now;
+    loop_timer_set(repeat->timer, repeat->interval, 0);
 
     return 0;
   }
@@ -69,7 +82,9 @@ static int repeat_apply(TranscodeContext *ctx, AVPacket *pkt)
         now - repeat->last_ts >= repeat->interval)
     {
       av_packet_ref(pkt, repeat->pkt);
+      pkt->flags |= PKT_FLAG_UNCHANGED;
       repeat->last_ts = now;
+      loop_timer_set(repeat->timer, repeat->interval, 0);
 
       return 0;
     }
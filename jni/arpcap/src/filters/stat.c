@@ -17,6 +17,7 @@
 #include <transcode.h>
 
 #include <assert.h>
+#include <unistd.h>
 
 #include <libavformat/avformat.h>
 #include <libavutil/time.h>
@@ -36,9 +37,11 @@ typedef struct {
   double bitrate;
   double i_bitrate;
   double max_bitrate;
+
+  int timer;
 } StatContext;
 
-static void stat_info(StatContext *stat, AVPacket *pkt);
+static void stat_info(StatContext *stat, AVPacket *pkt, double rate, int force);
 
 static int stat_init(TranscodeContext *ctx, int type)
 {
@@ -51,14 +54,21 @@ static int stat_init(TranscodeContext *ctx, int type)
   stat->i_bitrate = 0.0;
   stat->max_bitrate = 0.0;
 
-  return 0;
+  // Keep reporting while no packets flow.
+  stat->timer = loop_timer_create(); assert(stat->timer >= 0);
+  loop_timer_set(stat->timer, INFO_INTERVAL, 1);
+
+  return loop_add(ctx->loop, stat->timer);
 }
 
 static int stat_fini(TranscodeContext *ctx)
 {
   StatContext *stat = (StatContext *) ctx->priv_data;
 
-  stat_info(stat, NULL);
+  stat_info(stat, NULL, ctx->capture_rate, 1);
+
+  loop_remove(ctx->loop, stat->timer);
+  close(stat->timer);
 
   return 0;
 }
@@ -69,17 +79,19 @@ static int stat_apply(TranscodeContext *ctx, AVPacket *pkt)
 
   if (pkt != NULL && pkt->data != NULL)
   {
-    stat_info(stat, pkt);
+    stat_info(stat, pkt, ctx->capture_rate, 0);
 
     return 0;
   }
   else
   {
+    stat_info(stat, NULL, ctx->capture_rate, 0);
+
     return AVERROR(EAGAIN);
   }
 }
 
-static void stat_info(StatContext *stat, AVPacket *pkt)
+static void stat_info(StatContext *stat, AVPacket *pkt, double rate, int force)
 {
   if (pkt != NULL)
   {
@@ -93,12 +105,12 @@ static void stat_info(StatContext *stat, AVPacket *pkt)
     stat->pts = av_rescale_q(pkt->pts, av_make_q(1, stat->fps * 1000), AV_TIME_BASE_Q);
   }
 
-  int64_t now = av_gettime();
+  int64_t now = av_gettime_relative();
   if (stat->last == 0)
   {
     stat->last = now;
   }
-  else if (pkt == NULL || now - stat->last >= INFO_INTERVAL)
+  else if (force || now - stat->last >= INFO_INTERVAL)
   {
     stat->secs = FFABS(stat->pts) / AV_TIME_BASE;
     stat->us = FFABS(stat->pts) % AV_TIME_BASE;
@@ -112,10 +124,10 @@ static void stat_info(StatContext *stat, AVPacket *pkt)
        stat->max_bitrate = stat->i_bitrate;
     }
 
-    fprintf(stderr, "\rf=%5d s=%6.2fMB t=%02d:%02d.%02d b=%7.1fkb/s %6.1f(%6.1f)kb/s",
+    fprintf(stderr, "\rf=%5d s=%6.2fMB t=%02d:%02d.%02d b=%7.1fkb/s %6.1f(%6.1f)kb/s r=%4.1f",
             stat->frames, stat->total_size / 1024.0 / 1024.0,
             stat->mins, stat->secs, (100 * stat->us) / AV_TIME_BASE,
-            stat->bitrate, stat->i_bitrate, stat->max_bitrate);
+            stat->bitrate, stat->i_bitrate, stat->max_bitrate, rate);
 
     stat->i_total_size = 0;
     stat->last = now;
@@ -0,0 +1,429 @@
+/*
+ * Copyright 2018 ARP Network
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <encoder.h>
+#include <roi.h>
+#include <thread_policy.h>
+#include <transcode.h>
+#include <utils.h>
+
+#include <libavutil/fifo.h>
+#include <libavutil/time.h>
+
+#include <assert.h>
+#include <x264.h>
+
+/*
+ * H.264 encoder calling libx264 directly. Pictures are encoded from the
+ * capture buffers, and packets point into x264's NAL buffer, which holds
+ * until the next call: the filters after this one consume them right away,
+ * or reference them, which copies. Packets held back by a switch or behind
+ * those are copied into the queue.
+ */
+typedef struct {
+  x264_t *encoder;
+  int width;
+  int height;
+  // Encoder of the previous frame size, as in the av filter.
+  x264_t *spare;
+  int spare_width;
+  int spare_height;
+  int64_t next_pts;
+  // Copies of the packets not emitted yet, one goes out per call, as in the
+  // av filter.
+  AVFifoBuffer *queue;
+  // With quant offsets, pictures before the next keyframe placed by
+  // x264_apply().
+  int frames_to_keyframe;
+
+  int frames;
+  int64_t encode_time;
+  int64_t max_encode_time;
+} X264Context;
+
+static x264_t *start_x264(TranscodeContext *ctx, int width, int height, int csp);
+static x264_t *open_x264(TranscodeParam *param, int width, int height, int csp);
+static void switch_x264(TranscodeContext *ctx, X264Context *x, const PktFrame *desc, int csp);
+static void x264_packet(TranscodeContext *ctx, AVPacket *pkt, x264_nal_t *nals, int size,
+                        const x264_picture_t *out);
+static int queue_x264_packet(TranscodeContext *ctx, X264Context *x, x264_nal_t *nals,
+                             int size, const x264_picture_t *out);
+static void drain_x264(TranscodeContext *ctx, X264Context *x);
+static int next_x264_packet(X264Context *x, AVPacket *pkt);
+
+static int x264_init(TranscodeContext *ctx, int type)
+{
+  (void) type;
+
+  X264Context *x = (X264Context *) ctx->priv_data;
+  x->queue = av_fifo_alloc(8 * sizeof (AVPacket *));
+
+  return x->queue != NULL ? 0 : AVERROR(ENOMEM);
+}
+
+static int x264_fini(TranscodeContext *ctx)
+{
+  X264Context *x = (X264Context *) ctx->priv_data;
+
+  if (x->frames > 0)
+  {
+    av_log(NULL, AV_LOG_INFO, "Encoded %d frames with x264, %.3f ms/frame, max %.3f ms.\n",
+           x->frames, x->encode_time / 1000.0 / x->frames, x->max_encode_time / 1000.0);
+  }
+
+  if (x->encoder != NULL) x264_encoder_close(x->encoder);
+  if (x->spare != NULL) x264_encoder_close(x->spare);
+
+  AVPacket *queued = NULL;
+  while (x->queue != NULL && av_fifo_size(x->queue) > 0)
+  {
+    av_fifo_generic_read(x->queue, &queued, sizeof (queued), NULL);
+    av_packet_free(&queued);
+  }
+  av_fifo_freep(&x->queue);
+
+  return 0;
+}
+
+static int x264_apply(TranscodeContext *ctx, AVPacket *pkt)
+{
+  X264Context *x = (X264Context *) ctx->priv_data;
+
+  if (pkt == NULL) return AVERROR(EAGAIN);
+  // No new picture, the packets held back go out.
+  if (pkt->data == NULL) return next_x264_packet(x, pkt);
+
+  const PktFrame *desc = pkt_get_frame(pkt);
+  if (desc == NULL ||
+      (desc->format != AV_PIX_FMT_YUV420P && desc->format != AV_PIX_FMT_NV12))
+  {
+    av_packet_unref(pkt);
+    return AVERROR(EINVAL);
+  }
+  int csp = desc->format == AV_PIX_FMT_NV12 ? X264_CSP_NV12 : X264_CSP_I420;
+
+  x264_picture_t pic;
+  x264_picture_init(&pic);
+  if (x->encoder == NULL || x->width != desc->width || x->height != desc->height)
+  {
+    // The references of a resumed spare are stale, a new encoder starts
+    // with an IDR frame anyway.
+    switch_x264(ctx, x, desc, csp);
+    pic.i_type = X264_TYPE_IDR;
+  }
+
+  if (ctx->param.roi_offset > 0)
+  {
+    if (x->frames_to_keyframe <= 0)
+    {
+      pic.i_type = X264_TYPE_IDR;
+    }
+    if (pic.i_type == X264_TYPE_IDR)
+    {
+      x->frames_to_keyframe = ctx->param.gop;
+    }
+    x->frames_to_keyframe--;
+
+    // Keyframes are coded whole. x264 frees the offsets along with the
+    // picture, which it may hold for a few frames.
+    if (pic.i_type != X264_TYPE_IDR)
+    {
+      pic.prop.quant_offsets = roi_packet_quant_offsets(pkt, ctx->param.roi_offset);
+      pic.prop.quant_offsets_free = av_free;
+    }
+  }
+
+  pic.img.i_csp = csp;
+  pic.img.i_plane = csp == X264_CSP_NV12 ? 2 : 3;
+  for (int i = 0; i < pic.img.i_plane; i++)
+  {
+    pic.img.plane[i] = pkt->data + desc->offset[i];
+    pic.img.i_stride[i] = desc->linesize[i];
+  }
+  pic.i_pts = x->next_pts;
+
+  x264_nal_t *nals = NULL;
+  int nb_nals = 0;
+  x264_picture_t out;
+
+  int64_t start = av_gettime_relative();
+  int size = x264_encoder_encode(x->encoder, &nals, &nb_nals, &pic, &out);
+  int64_t elapsed = av_gettime_relative() - start;
+
+  // x264 has copied the picture.
+  av_packet_unref(pkt);
+  if (size < 0)
+  {
+    return -1;
+  }
+
+  x->frames++;
+  x->encode_time += elapsed;
+  x->max_encode_time = FFMAX(x->max_encode_time, elapsed);
+  x->next_pts += 1000;
+
+  if (size == 0)
+  {
+    return next_x264_packet(x, pkt);
+  }
+  // Behind the queued packets, the NAL buffer does not last until then.
+  if (av_fifo_size(x->queue) > 0)
+  {
+    if (queue_x264_packet(ctx, x, nals, size, &out) < 0)
+    {
+      return AVERROR(ENOMEM);
+    }
+    return next_x264_packet(x, pkt);
+  }
+  x264_packet(ctx, pkt, nals, size, &out);
+
+  return 0;
+}
+
+// Frame threads and the lookahead hold frames back, they are encoded on
+// shutdown after the queued packets.
+static int x264_flush(TranscodeContext *ctx, AVPacket *pkt)
+{
+  X264Context *x = (X264Context *) ctx->priv_data;
+
+  if (next_x264_packet(x, pkt) == 0)
+  {
+    return 0;
+  }
+
+  while (x->encoder != NULL && x264_encoder_delayed_frames(x->encoder) > 0)
+  {
+    x264_nal_t *nals = NULL;
+    int nb_nals = 0;
+    x264_picture_t out;
+
+    int size = x264_encoder_encode(x->encoder, &nals, &nb_nals, NULL, &out);
+    if (size < 0)
+    {
+      return -1;
+    }
+    if (size > 0)
+    {
+      x264_packet(ctx, pkt, nals, size, &out);
+      return 0;
+    }
+  }
+
+  return AVERROR_EOF;
+}
+
+// The NAL payloads follow each other in x264's buffer.
+void x264_packet(TranscodeContext *ctx, AVPacket *pkt, x264_nal_t *nals, int size,
+                 const x264_picture_t *out)
+{
+  pkt->data = nals[0].p_payload;
+  pkt->size = size;
+  pkt->pts = out->i_pts;
+  pkt->dts = out->i_dts;
+  pkt->duration = 1000;
+  if (out->b_keyframe)
+  {
+    pkt->flags |= AV_PKT_FLAG_KEY;
+  }
+  pkt->stream_index = ctx->type;
+}
+
+int queue_x264_packet(TranscodeContext *ctx, X264Context *x, x264_nal_t *nals, int size,
+                      const x264_picture_t *out)
+{
+  AVPacket nal;
+  av_init_packet(&nal);
+  x264_packet(ctx, &nal, nals, size, out);
+
+  // Referencing a packet without a buffer copies its data.
+  AVPacket *copy = av_packet_alloc();
+  if (copy == NULL || av_packet_ref(copy, &nal) < 0)
+  {
+    av_packet_free(&copy);
+    return AVERROR(ENOMEM);
+  }
+
+  if (av_fifo_space(x->queue) < (int) sizeof (copy) &&
+      av_fifo_grow(x->queue, av_fifo_size(x->queue)) < 0)
+  {
+    av_packet_free(&copy);
+    return AVERROR(ENOMEM);
+  }
+  av_fifo_generic_write(x->queue, &copy, sizeof (copy), NULL);
+
+  return 0;
+}
+
+// Queues the frames in flight and closes the encoder, see drain_encoder()
+// in av.c.
+void drain_x264(TranscodeContext *ctx, X264Context *x)
+{
+  while (x264_encoder_delayed_frames(x->encoder) > 0)
+  {
+    x264_nal_t *nals = NULL;
+    int nb_nals = 0;
+    x264_picture_t out;
+
+    int size = x264_encoder_encode(x->encoder, &nals, &nb_nals, NULL, &out);
+    if (size < 0 || (size > 0 && queue_x264_packet(ctx, x, nals, size, &out) < 0))
+    {
+      av_log(NULL, AV_LOG_WARNING, "Lost %d frames draining the encoder.\n",
+             x264_encoder_delayed_frames(x->encoder));
+      break;
+    }
+  }
+  x264_encoder_close(x->encoder);
+  x->encoder = NULL;
+}
+
+int next_x264_packet(X264Context *x, AVPacket *pkt)
+{
+  if (av_fifo_size(x->queue) == 0)
+  {
+    return AVERROR(EAGAIN);
+  }
+
+  AVPacket *queued = NULL;
+  av_fifo_generic_read(x->queue, &queued, sizeof (queued), NULL);
+  av_packet_move_ref(pkt, queued);
+  av_packet_free(&queued);
+
+  return 0;
+}
+
+// Makes the encoder match the picture size, see switch_encoder() in av.c.
+void switch_x264(TranscodeContext *ctx, X264Context *x, const PktFrame *desc, int csp)
+{
+  int64_t start = av_gettime_relative();
+
+  x264_t *encoder = x->spare;
+  if (encoder == NULL || x->spare_width != desc->width || x->spare_height != desc->height)
+  {
+    if (encoder != NULL) x264_encoder_close(encoder);
+    encoder = start_x264(ctx, desc->width, desc->height, csp);
+    assert(encoder != NULL);
+  }
+
+  if (x->encoder != NULL)
+  {
+    av_log(NULL, AV_LOG_INFO, "Switched encoder from %dx%d to %dx%d in %.1f ms.\n",
+           x->width, x->height, desc->width, desc->height,
+           (av_gettime_relative() - start) / 1000.0);
+  }
+  // Frames in flight come out before the first one of the new size. A
+  // drained encoder is not kept as the spare.
+  if (x->encoder != NULL && x264_encoder_delayed_frames(x->encoder) > 0)
+  {
+    drain_x264(ctx, x);
+  }
+  x->spare = x->encoder;
+  x->spare_width = x->width;
+  x->spare_height = x->height;
+  x->encoder = encoder;
+  x->width = desc->width;
+  x->height = desc->height;
+}
+
+x264_t *start_x264(TranscodeContext *ctx, int width, int height, int csp)
+{
+  TranscodeParam *param = &ctx->param;
+
+  ThreadSwitch saved;
+  thread_switch_encoder(&saved, &param->encoder_policy, &param->capture_policy);
+  x264_t *encoder = open_x264(param, width, height, csp);
+  thread_switch_back(&saved);
+
+  return encoder;
+}
+
+// The settings of open_h264_encoder() in av.c, as libavcodec passes them on.
+x264_t *open_x264(TranscodeParam *param, int width, int height, int csp)
+{
+  x264_param_t p;
+
+  if (x264_param_default_preset(&p, param->preset, "zerolatency") < 0)
+  {
+    av_log(NULL, AV_LOG_ERROR, "Unknown preset %s.\n", param->preset);
+    return NULL;
+  }
+  p.i_log_level = X264_LOG_WARNING;
+
+  EncoderThreads threads;
+  encoder_threads_resolve(&param->encoder_threads, param->encoder_policy.cpus,
+                          width, height, &threads);
+  // Like libavcodec, 0 leaves the count to x264 (X264_THREADS_AUTO) and the
+  // type to the tune, sliced threads with zerolatency.
+  p.i_threads = threads.threads;
+  if (threads.type != THREAD_TYPE_DEFAULT)
+  {
+    p.b_sliced_threads = threads.type == THREAD_TYPE_SLICE;
+  }
+  if (threads.lookahead >= 0)
+  {
+    p.rc.i_lookahead = threads.lookahead;
+  }
+  if (threads.sync_lookahead >= 0)
+  {
+    p.i_sync_lookahead = threads.sync_lookahead;
+  }
+
+  p.i_width = width;
+  p.i_height = height;
+  p.i_csp = csp;
+  p.i_level_idc = 52;
+  p.i_keyint_max = param->gop;
+  p.b_intra_refresh = param->intra_refresh;
+  if (param->roi_offset > 0)
+  {
+    // x264_apply() places the keyframes, the pictures it codes with quant
+    // offsets must not become one. arpcap rejects it with intra refresh.
+    p.i_scenecut_threshold = 0;
+    p.i_keyint_max = X264_KEYINT_MAX_INFINITE;
+  }
+  p.i_bframe = 0;
+  p.b_repeat_headers = 1;
+  p.i_fps_num = param->framerate;
+  p.i_fps_den = 1;
+  p.i_timebase_num = 1;
+  p.i_timebase_den = param->framerate * 1000;
+
+  // CRF, the default of the preset, capped by the bitrate.
+  if (param->crf > 0)
+  {
+    p.rc.f_rf_constant = param->crf;
+  }
+  if (param->bitrate > 0)
+  {
+    p.rc.i_vbv_max_bitrate = param->bitrate;
+    p.rc.i_vbv_buffer_size = param->bitrate;
+  }
+
+  if (x264_param_apply_profile(&p, "high") < 0)
+  {
+    return NULL;
+  }
+
+  return x264_encoder_open(&p);
+}
+
+Filter x264_filter = {
+  .name = "x264",
+  .priv_data_size = sizeof (X264Context),
+  .init = x264_init,
+  .fini = x264_fini,
+  .apply = x264_apply,
+  .flush = x264_flush
+};
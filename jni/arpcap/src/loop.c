@@ -0,0 +1,118 @@
+/*
+ * Copyright 2018 ARP Network
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "loop.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#define MAX_EVENTS 16
+
+struct EventLoop {
+  int epfd;
+  int wakeup;
+};
+
+EventLoop *loop_create()
+{
+  EventLoop *loop = (EventLoop *) malloc(sizeof (EventLoop));
+
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+  loop->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (loop->epfd < 0 || loop->wakeup < 0 || loop_add(loop, loop->wakeup) < 0)
+  {
+    loop_destroy(loop);
+    return NULL;
+  }
+
+  return loop;
+}
+
+void loop_destroy(EventLoop *loop)
+{
+  if (loop->wakeup >= 0) close(loop->wakeup);
+  if (loop->epfd >= 0) close(loop->epfd);
+  free(loop);
+}
+
+int loop_add(EventLoop *loop, int fd)
+{
+  struct epoll_event event;
+  memset(&event, 0, sizeof (event));
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+
+  return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &event);
+}
+
+void loop_remove(EventLoop *loop, int fd)
+{
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int loop_wait(EventLoop *loop, int timeout)
+{
+  struct epoll_event events[MAX_EVENTS];
+
+  int n = epoll_wait(loop->epfd, events, MAX_EVENTS, timeout);
+  if (n < 0)
+  {
+    return errno == EINTR ? 0 : -1;
+  }
+
+  // Both eventfds and timerfds hold an 8 byte counter.
+  uint64_t value;
+  for (int i = 0; i < n; i++)
+  {
+    if (read(events[i].data.fd, &value, sizeof (value)) < 0 && errno != EAGAIN)
+    {
+      return -1;
+    }
+  }
+
+  return n;
+}
+
+void loop_wakeup(EventLoop *loop)
+{
+  uint64_t value = 1;
+  write(loop->wakeup, &value, sizeof (value));
+}
+
+int loop_timer_create()
+{
+  return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+}
+
+int loop_timer_set(int fd, int64_t us, int periodic)
+{
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof (spec));
+  spec.it_value.tv_sec = us / 1000000;
+  spec.it_value.tv_nsec = (us % 1000000) * 1000;
+  if (periodic)
+  {
+    spec.it_interval = spec.it_value;
+  }
+
+  return timerfd_settime(fd, 0, &spec, NULL);
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2018 ARP Network
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <roi.h>
+
+#include <stdint.h>
+
+void roi_quant_offsets(float *offsets, int width, int height,
+                       const PktDamage *damage, float static_offset)
+{
+  int mb_width = (width + 15) / 16;
+  int mb_height = (height + 15) / 16;
+  const uint8_t *dirty = damage != NULL ? PKT_DAMAGE_TILES(damage) : NULL;
+
+  for (int y = 0; y < mb_height; y++)
+  {
+    for (int x = 0; x < mb_width; x++)
+    {
+      int changed = 0;
+      if (dirty != NULL)
+      {
+        int tx = FFMIN(x * 16 / damage->tile_size, damage->tiles_x - 1);
+        int ty = FFMIN(y * 16 / damage->tile_size, damage->tiles_y - 1);
+        changed = dirty[ty * damage->tiles_x + tx];
+      }
+      offsets[y * mb_width + x] = changed ? 0.0f : static_offset;
+    }
+  }
+}
+
+float *roi_packet_quant_offsets(const AVPacket *pkt, float static_offset)
+{
+  const PktFrame *desc = pkt_get_frame(pkt);
+  if (desc == NULL)
+  {
+    return NULL;
+  }
+
+  const PktDamage *damage = NULL;
+  if (!(pkt->flags & PKT_FLAG_UNCHANGED))
+  {
+    int size = 0;
+    damage = (const PktDamage *) av_packet_get_side_data(pkt, PKT_DATA_DAMAGE, &size);
+    if (damage == NULL)
+    {
+      return NULL;
+    }
+  }
+
+  int count = ((desc->width + 15) / 16) * ((desc->height + 15) / 16);
+  float *offsets = av_malloc_array(count, sizeof (float));
+  if (offsets != NULL)
+  {
+    roi_quant_offsets(offsets, desc->width, desc->height, damage, static_offset);
+  }
+
+  return offsets;
+}
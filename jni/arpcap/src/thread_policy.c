@@ -0,0 +1,345 @@
+/*
+ * Copyright 2018 ARP Network
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <thread_policy.h>
+
+#include <libavutil/log.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#define MAX_THREADS 128
+
+typedef struct ThreadTimes {
+  pid_t tid;
+  char name[16];
+  double user;
+  double system;
+  int cpu;
+  int nice;
+  int policy;
+  int priority;
+  char cpus[64];
+} ThreadTimes;
+
+static pthread_once_t default_cpus_once = PTHREAD_ONCE_INIT;
+static cpu_set_t default_cpus;
+
+static pthread_mutex_t times_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ThreadTimes times[MAX_THREADS];
+static int nb_times = 0;
+
+static void init_default_cpus(void);
+static pid_t get_tid(void);
+static int read_thread_times(pid_t tid, double tick, ThreadTimes *times);
+
+int thread_parse_cpus(const char *list, uint64_t *cpus)
+{
+  *cpus = 0;
+
+  const char *p = list;
+  while (*p != '\0')
+  {
+    char *end;
+    long first = strtol(p, &end, 10);
+    if (end == p || first < 0 || first >= 64)
+    {
+      return -1;
+    }
+    long last = first;
+    if (*end == '-')
+    {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first || last >= 64)
+      {
+        return -1;
+      }
+    }
+    for (long cpu = first; cpu <= last; cpu++)
+    {
+      *cpus |= 1ULL << cpu;
+    }
+
+    if (*end == ',')
+    {
+      end++;
+    }
+    else if (*end != '\0')
+    {
+      return -1;
+    }
+    p = end;
+  }
+
+  return *cpus != 0 ? 0 : -1;
+}
+
+int thread_policy_isset(const ThreadPolicy *policy)
+{
+  return policy->cpus != 0 || policy->fifo_priority > 0 || policy->set_nice;
+}
+
+void thread_apply_policy(const ThreadPolicy *policy)
+{
+  // Taken before any thread is moved.
+  pthread_once(&default_cpus_once, init_default_cpus);
+
+  pid_t tid = get_tid();
+
+  cpu_set_t cpus = default_cpus;
+  if (policy->cpus != 0)
+  {
+    CPU_ZERO(&cpus);
+    for (int cpu = 0; cpu < 64; cpu++)
+    {
+      if (policy->cpus & (1ULL << cpu))
+      {
+        CPU_SET(cpu, &cpus);
+      }
+    }
+  }
+  if (CPU_COUNT(&cpus) > 0 && sched_setaffinity(tid, sizeof (cpus), &cpus) < 0)
+  {
+    av_log(NULL, AV_LOG_WARNING, "Cannot set the CPU affinity: %s.\n", strerror(errno));
+  }
+
+  int current;
+  struct sched_param param;
+  pthread_getschedparam(pthread_self(), &current, &param);
+  if (policy->fifo_priority > 0 || current == SCHED_FIFO)
+  {
+    param.sched_priority = policy->fifo_priority;
+    int ret = pthread_setschedparam(pthread_self(),
+                                    policy->fifo_priority > 0 ? SCHED_FIFO : SCHED_OTHER,
+                                    &param);
+    if (ret != 0)
+    {
+      av_log(NULL, AV_LOG_WARNING, "Cannot set the SCHED_FIFO priority %d: %s.\n",
+             policy->fifo_priority, strerror(ret));
+    }
+  }
+
+  // The nice level of a Linux thread is set through its thread ID.
+  if (policy->set_nice && setpriority(PRIO_PROCESS, tid, policy->nice) < 0)
+  {
+    av_log(NULL, AV_LOG_WARNING, "Cannot set the nice level %d: %s.\n",
+           policy->nice, strerror(errno));
+  }
+}
+
+void thread_switch(ThreadSwitch *saved, const char *name,
+                   const ThreadPolicy *policy, const ThreadPolicy *restore)
+{
+  thread_get_name(saved->name);
+  saved->restore = restore;
+  saved->placed = thread_policy_isset(policy) || thread_policy_isset(restore);
+
+  thread_set_name(name);
+  if (saved->placed)
+  {
+    thread_apply_policy(policy);
+  }
+}
+
+void thread_switch_encoder(ThreadSwitch *saved, const ThreadPolicy *encoder,
+                           const ThreadPolicy *capture)
+{
+  thread_switch(saved, "encoder", encoder, capture);
+}
+
+void thread_switch_back(ThreadSwitch *saved)
+{
+  if (saved->placed)
+  {
+    thread_apply_policy(saved->restore);
+  }
+  thread_set_name(saved->name);
+}
+
+void thread_set_name(const char *name)
+{
+  char truncated[16];
+  snprintf(truncated, sizeof (truncated), "%s", name);
+  pthread_setname_np(pthread_self(), truncated);
+}
+
+void thread_get_name(char *name)
+{
+  name[0] = '\0';
+  prctl(PR_GET_NAME, name);
+}
+
+void thread_times_sample(void)
+{
+  DIR *dir = opendir("/proc/self/task");
+  if (dir == NULL)
+  {
+    return;
+  }
+  double tick = 1.0 / sysconf(_SC_CLK_TCK);
+
+  pthread_mutex_lock(&times_mutex);
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    ThreadTimes sample;
+    if (entry->d_name[0] == '.' || read_thread_times(atoi(entry->d_name), tick, &sample) < 0)
+    {
+      continue;
+    }
+
+    int i = 0;
+    while (i < nb_times && times[i].tid != sample.tid)
+    {
+      i++;
+    }
+    if (i == MAX_THREADS)
+    {
+      continue;
+    }
+    if (i == nb_times)
+    {
+      nb_times++;
+    }
+    times[i] = sample;
+  }
+  pthread_mutex_unlock(&times_mutex);
+
+  closedir(dir);
+}
+
+void thread_times_report(FILE *out)
+{
+  pthread_mutex_lock(&times_mutex);
+  fprintf(out, "%-15s %7s %9s %9s %4s %-16s %5s %s\n",
+          "Thread", "TID", "User", "System", "CPU", "Allowed CPUs", "Nice", "Policy");
+  for (int i = 0; i < nb_times; i++)
+  {
+    const ThreadTimes *t = &times[i];
+    char policy[16];
+    if (t->policy == SCHED_FIFO)
+    {
+      snprintf(policy, sizeof (policy), "fifo/%d", t->priority);
+    }
+    else
+    {
+      snprintf(policy, sizeof (policy), "other");
+    }
+    fprintf(out, "%-15s %7d %8.2fs %8.2fs %4d %-16s %5d %s\n",
+            t->name, (int) t->tid, t->user, t->system, t->cpu, t->cpus, t->nice, policy);
+  }
+  pthread_mutex_unlock(&times_mutex);
+}
+
+void init_default_cpus(void)
+{
+  if (sched_getaffinity(0, sizeof (default_cpus), &default_cpus) < 0)
+  {
+    CPU_ZERO(&default_cpus);
+  }
+}
+
+pid_t get_tid(void)
+{
+  return (pid_t) syscall(SYS_gettid);
+}
+
+// Reads /proc/self/task/TID/stat, see proc(5), and the allowed CPUs.
+int read_thread_times(pid_t tid, double tick, ThreadTimes *times)
+{
+  char path[64];
+  char line[1024];
+
+  snprintf(path, sizeof (path), "/proc/self/task/%d/stat", (int) tid);
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+  {
+    return -1;
+  }
+  size_t size = fread(line, 1, sizeof (line) - 1, file);
+  fclose(file);
+  line[size] = '\0';
+
+  // The name may hold spaces and parentheses, it ends at the last ')'.
+  char *name = strchr(line, '(');
+  char *end = strrchr(line, ')');
+  if (name == NULL || end == NULL || end < name || end[1] == '\0')
+  {
+    return -1;
+  }
+
+  memset(times, 0, sizeof (*times));
+  times->tid = tid;
+  snprintf(times->name, sizeof (times->name), "%.*s", (int) (end - name - 1), name + 1);
+
+  // Fields are numbered from 1, the state that follows the name is the 3rd.
+  char *saveptr;
+  int field = 3;
+  for (char *token = strtok_r(end + 2, " ", &saveptr); token != NULL;
+       token = strtok_r(NULL, " ", &saveptr), field++)
+  {
+    switch (field)
+    {
+    case 14:
+      times->user = strtoull(token, NULL, 10) * tick;
+      break;
+    case 15:
+      times->system = strtoull(token, NULL, 10) * tick;
+      break;
+    case 19:
+      times->nice = atoi(token);
+      break;
+    case 39:
+      times->cpu = atoi(token);
+      break;
+    case 40:
+      times->priority = atoi(token);
+      break;
+    case 41:
+      times->policy = atoi(token);
+      break;
+    }
+  }
+
+  snprintf(path, sizeof (path), "/proc/self/task/%d/status", (int) tid);
+  file = fopen(path, "r");
+  if (file != NULL)
+  {
+    while (fgets(line, sizeof (line), file) != NULL)
+    {
+      if (strncmp(line, "Cpus_allowed_list:", 18) == 0)
+      {
+        sscanf(line + 18, "%63s", times->cpus);
+        break;
+      }
+    }
+    fclose(file);
+  }
+
+  return 0;
+}
@@ -16,13 +16,24 @@
 
 #include "utils.h"
 
+#include <alloc.h>
+
 #include <libavutil/imgutils.h>
 
 #include <assert.h>
 #include <unistd.h>
 
+static int new_frame_from_picture(AVFrame *frame, AVPacket *pkt, const PktFrame *desc);
 static int new_frame_from_data(AVFrame *frame, uint8_t *data, int size);
 
+const PktFrame *pkt_get_frame(const AVPacket *pkt)
+{
+  int size = 0;
+  const PktFrame *desc = (const PktFrame *) av_packet_get_side_data(pkt, PKT_DATA_FRAME, &size);
+
+  return size == sizeof (PktFrame) ? desc : NULL;
+}
+
 int new_packet_from_data(AVPacket *pkt, uint8_t *data, int size)
 {
   assert(pkt != NULL && pkt->data == NULL);
@@ -47,11 +58,17 @@ int new_packet_from_frame(AVPacket *pkt, AVFrame *frame)
 
 int new_frame_from_packet(AVFrame *frame, AVPacket *pkt)
 {
+  int ret = AVERROR(EINVAL);
   if (pkt->stream_index == AVMEDIA_TYPE_VIDEO) // Video
   {
-    frame->width  = PKT_WIDTH(pkt);
-    frame->height = PKT_HEIGHT(pkt);
-    frame->format = AV_PIX_FMT_YUV420P;
+    const PktFrame *desc = pkt_get_frame(pkt);
+    if (desc != NULL)
+    {
+      frame->width  = desc->width;
+      frame->height = desc->height;
+      frame->format = desc->format;
+      ret = new_frame_from_picture(frame, pkt, desc);
+    }
   }
   else  // Audio
   {
@@ -61,36 +78,64 @@ int new_frame_from_packet(AVFrame *frame, AVPacket *pkt)
     frame->sample_rate = 44100;
     frame->nb_samples =
         pkt->size / (av_get_bytes_per_sample(frame->format) * frame->channels);
+    ret = new_frame_from_data(frame, pkt->data, pkt->size);
   }
-  new_frame_from_data(frame, pkt->data, pkt->size);
   av_packet_unref(pkt);
 
-  return 0;
+  return ret;
 }
 
-int new_frame_from_data(AVFrame *frame, uint8_t *data, int size)
+// The frame references the packet buffer when there is one, cap aligns the
+// planes and their rows for the encoder.
+int new_frame_from_picture(AVFrame *frame, AVPacket *pkt, const PktFrame *desc)
 {
-  (void) size;
+  if (pkt->buf != NULL)
+  {
+    frame->buf[0] = av_buffer_ref(pkt->buf);
+    if (frame->buf[0] == NULL)
+    {
+      return AVERROR(ENOMEM);
+    }
+    for (int i = 0; i < 4 && desc->linesize[i] > 0; i++)
+    {
+      frame->data[i] = pkt->data + desc->offset[i];
+      frame->linesize[i] = desc->linesize[i];
+    }
+    frame->extended_data = frame->data;
 
-  av_frame_get_buffer(frame, 32);
+    return 0;
+  }
 
-  uint8_t *src_data[4];
-  int src_linesize[4];
-  if (frame->nb_samples == 0) // Video
+  int ret = av_frame_get_buffer(frame, FRAME_ALIGN);
+  if (ret < 0)
   {
-    av_image_fill_arrays(src_data, src_linesize, data,
-                         frame->format, frame->width, frame->height, 4);
-    av_image_copy(frame->data, frame->linesize,
-                  (const uint8_t **) src_data, src_linesize,
-                  frame->format, frame->width, frame->height);
+    return ret;
   }
-  else  // Audio
+
+  uint8_t *data = pkt->data;
+  const uint8_t *src_data[4] = { NULL };
+  for (int i = 0; i < 4 && desc->linesize[i] > 0; i++)
   {
-    av_samples_fill_arrays(src_data, src_linesize, data,
-                           frame->channels, frame->nb_samples, frame->format, 4);
-    av_samples_copy(frame->data, src_data,
-                    0, 0, frame->nb_samples, frame->channels, frame->format);
+    src_data[i] = data + desc->offset[i];
   }
+  av_image_copy(frame->data, frame->linesize, src_data, desc->linesize,
+                frame->format, frame->width, frame->height);
+
+  return 0;
+}
+
+int new_frame_from_data(AVFrame *frame, uint8_t *data, int size)
+{
+  (void) size;
+
+  uint8_t *src_data[4];
+  int src_linesize[4];
+
+  av_frame_get_buffer(frame, 32);
+  av_samples_fill_arrays(src_data, src_linesize, data,
+                         frame->channels, frame->nb_samples, frame->format, 4);
+  av_samples_copy(frame->data, src_data,
+                  0, 0, frame->nb_samples, frame->channels, frame->format);
 
   return 0;
 }
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2018 ARP Network
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "workers.h"
+
+#include <thread_policy.h>
+
+WorkerPool::WorkerPool(int size, const char *name) :
+    mName(name),
+    mTask(nullptr),
+    mCount(0),
+    mNext(0),
+    mPending(0),
+    mGeneration(0),
+    mStopped(false)
+{
+    for (int i = 1; i < size; i++) {
+        mThreads.emplace_back(&WorkerPool::loop, this, i);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mStopped = true;
+        mStart.notify_all();
+    }
+    for (auto &thread : mThreads) {
+        thread.join();
+    }
+}
+
+int WorkerPool::size() const {
+    return mThreads.size() + 1;
+}
+
+void WorkerPool::run(int count, const std::function<void(int)> &task) {
+    if (mThreads.empty() || count <= 1) {
+        for (int i = 0; i < count; i++) {
+            task(i);
+        }
+        return;
+    }
+
+    std::unique_lock<std::mutex> running(mRunMutex);
+    std::unique_lock<std::mutex> lock(mMutex);
+    mTask = &task;
+    mCount = count;
+    mNext = 0;
+    mPending = count;
+    mGeneration++;
+    mStart.notify_all();
+
+    int index;
+    while (next(&index)) {
+        lock.unlock();
+        task(index);
+        lock.lock();
+        mPending--;
+    }
+
+    mDone.wait(lock, [this] { return mPending == 0; });
+    mTask = nullptr;
+}
+
+void WorkerPool::loop(int thread) {
+    thread_set_name((mName + "-" + std::to_string(thread)).c_str());
+
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    uint64_t generation = mGeneration;
+    while (true) {
+        mStart.wait(lock, [this, generation] {
+            return mStopped || mGeneration != generation;
+        });
+        if (mStopped) {
+            break;
+        }
+        generation = mGeneration;
+
+        int index;
+        while (next(&index)) {
+            const std::function<void(int)> *task = mTask;
+            lock.unlock();
+            (*task)(index);
+            lock.lock();
+            if (--mPending == 0) {
+                mDone.notify_one();
+            }
+        }
+    }
+}
+
+bool WorkerPool::next(int *index) {
+    if (mNext == mCount) {
+        return false;
+    }
+    *index = mNext++;
+    return true;
+}
@@ -1,11 +1,14 @@
 LOCAL_PATH := $(abspath $(call my-dir))
 include $(CLEAR_VARS)
 
+# Screen capture backend: 'dummy' (link stub) or 'synthetic' (generated frames).
+ARPCAP_BACKEND ?= dummy
+
 LOCAL_MODULE := libarpcap-shared
 LOCAL_MODULE_FILENAME := libarpcap
 
 LOCAL_SRC_FILES := \
-	dummy/ScreenCapture.cpp \
+	$(ARPCAP_BACKEND)/ScreenCapture.cpp \
 
 LOCAL_C_INCLUDES := \
 	$(LOCAL_PATH)/include \
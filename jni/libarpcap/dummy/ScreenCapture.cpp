@@ -26,6 +26,10 @@ int arpcap_get_display_info(ARPDisplayInfo *info) {
     return 0;
 }
 
+int arpcap_set_pixel_format(int32_t format) {
+    return 0;
+}
+
 int arpcap_create(
     uint32_t paddingTop, uint32_t paddingBottom, uint32_t width, uint32_t height, arp_callback cb)
 {
@@ -41,3 +45,50 @@ int arpcap_acquire_frame_buffer(ARPFrameBuffer *fb) {
 
 void arpcap_release_frame_buffer() {
 }
+
+int arpcap_get_api_version() {
+    return ARPCAP_API_VERSION;
+}
+
+int arpcap_get_max_acquired_frames() {
+    return 0;
+}
+
+int arpcap_acquire_frame(ARPFrame *frame) {
+    return 0;
+}
+
+void arpcap_release_frame(int32_t handle) {
+}
+
+int arpcap_discard_frames(uint32_t count) {
+    return 0;
+}
+
+int arpcap_get_display_info_for(uint32_t display, ARPDisplayInfo *info) {
+    return 0;
+}
+
+ARPSession *arpcap_session_create(
+    const ARPSessionParams *params, arp_session_callback cb, void *opaque)
+{
+    return nullptr;
+}
+
+void arpcap_session_destroy(ARPSession *session) {
+}
+
+int arpcap_session_get_max_acquired_frames(ARPSession *session) {
+    return 0;
+}
+
+int arpcap_session_acquire_frame(ARPSession *session, ARPFrame *frame) {
+    return 0;
+}
+
+void arpcap_session_release_frame(ARPSession *session, int32_t handle) {
+}
+
+int arpcap_session_discard_frames(ARPSession *session, uint32_t count) {
+    return 0;
+}
\ No newline at end of file
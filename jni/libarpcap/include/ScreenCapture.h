@@ -88,14 +88,68 @@ typedef struct ARPFrameBuffer {
     uint64_t    frame_number;
 } ARPFrameBuffer;
 
+/*
+ * API v2: frames are acquired by handle and several of them may be held at
+ * once, so a frame can be converted while the next one is being acquired.
+ *
+ * API v3: captures are sessions, several of which may run at once on the
+ * same or different displays. The callback gets the opaque pointer given
+ * when creating the session.
+ */
+#define ARPCAP_API_VERSION 3
+
+/*
+ * Frame version 2 adds the regions that changed since the previously
+ * acquired frame, including the changes of frames discarded in between.
+ * Backends only fill the fields of the version set by the caller.
+ */
+#define ARP_FRAME_VERSION 2
+
+#define ARP_MAX_DAMAGE_RECTS 16
+
+typedef struct ARPRect {
+    int32_t left;
+    int32_t top;
+    int32_t right;
+    int32_t bottom;
+} ARPRect;
+
+typedef struct ARPFrame {
+    uint32_t        version;    // ARP_FRAME_VERSION the caller was built with
+    int32_t         handle;
+    ARPFrameBuffer  fb;
+
+    // Version 2, in frame coordinates. -1 when the damage is unknown, in
+    // which case the whole frame must be assumed to have changed.
+    int32_t         num_damage_rects;
+    ARPRect         damage_rects[ARP_MAX_DAMAGE_RECTS];
+} ARPFrame;
+
 typedef void (*arp_callback)(uint64_t frame_number, int64_t timestamp);
 
+typedef void (*arp_session_callback)(void *opaque, uint64_t frame_number, int64_t timestamp);
+
+typedef struct ARPSession ARPSession;
+
+typedef struct ARPSessionParams {
+    uint32_t display;
+    uint32_t padding_top;
+    uint32_t padding_bottom;
+    uint32_t width;     // 0 for the display size
+    uint32_t height;
+    int32_t  format;    // PIXEL_FORMAT_NONE for the default format
+} ARPSessionParams;
+
 void arpcap_init();
 
 void arpcap_fini();
 
 int arpcap_get_display_info(ARPDisplayInfo *info);
 
+/* Requests a PIXEL_FORMAT_* for the frames of the next arpcap_create(),
+ * e.g. RGB_565 to halve memory bandwidth. Returns 0 if supported. */
+int arpcap_set_pixel_format(int32_t format);
+
 int arpcap_create(
     uint32_t paddingTop, uint32_t paddingBottom, uint32_t width, uint32_t height, arp_callback cb);
 
@@ -105,6 +159,34 @@ int arpcap_acquire_frame_buffer(ARPFrameBuffer *fb);
 
 void arpcap_release_frame_buffer();
 
+int arpcap_get_api_version();
+
+int arpcap_get_max_acquired_frames();
+
+int arpcap_acquire_frame(ARPFrame *frame);
+
+void arpcap_release_frame(int32_t handle);
+
+/* Drops up to count queued frames, oldest first, without acquiring them.
+ * Returns the number of frames dropped. */
+int arpcap_discard_frames(uint32_t count);
+
+int arpcap_get_display_info_for(uint32_t display, ARPDisplayInfo *info);
+
+/* The callback may be called before this returns. Returns NULL on error. */
+ARPSession *arpcap_session_create(
+    const ARPSessionParams *params, arp_session_callback cb, void *opaque);
+
+void arpcap_session_destroy(ARPSession *session);
+
+int arpcap_session_get_max_acquired_frames(ARPSession *session);
+
+int arpcap_session_acquire_frame(ARPSession *session, ARPFrame *frame);
+
+void arpcap_session_release_frame(ARPSession *session, int32_t handle);
+
+int arpcap_session_discard_frames(ARPSession *session, uint32_t count);
+
 #ifdef __cplusplus
 }
 #endif
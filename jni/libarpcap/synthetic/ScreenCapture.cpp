@@ -0,0 +1,683 @@
+/*
+ * Copyright 2018 ARP Network
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Synthetic screen capture backend.
+ *
+ * Renders a gradient with a moving box into a small ring of frame buffers and
+ * fires the frame callback on a vsync grid, so the capture pipeline can be
+ * exercised without a device. Frames report the box movement as damage.
+ * The schedule is configured through the ARPCAP_SYNTHETIC environment
+ * variable, a comma separated list of:
+ *
+ *   size=WxH       display size [1280x720]
+ *   stride=N       row stride in pixels [width aligned to 16]
+ *   format=FMT     rgba, rgbx, bgra or rgb565 [rgba]
+ *   fps=N          refresh rate [60]
+ *   vsync=0|1      report ideal vsync timestamps instead of delivery time [1]
+ *   jitter=MS      random delivery delay added to every frame [0]
+ *   burst=N/M      every M frames, deliver N frames back to back [0/0]
+ *   box=WxH        size of the moving box [128x128]
+ *   speed=N        box movement in pixels per frame [8]
+ *   motion=N/M     only move the box during N frames out of every M [0/0]
+ *   buffers=N      number of frame buffers [4]
+ *   native=0|1     deliver display size frames whatever size is requested [0]
+ *   displays=N     number of displays, all configured alike [1]
+ *   rotate=N       swap the width and height every N frames [0]
+ *   api=N          API version reported to the caller [3]
+ */
+
+#include <ScreenCapture.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOGE(format, ...) fprintf(stderr, "[SYNTHETIC] " format "\n", ##__VA_ARGS__)
+
+namespace {
+
+struct Config {
+    uint32_t width{1280};
+    uint32_t height{720};
+    uint32_t stride{0};
+    int32_t  format{PIXEL_FORMAT_RGBA_8888};
+    int      fps{60};
+    bool     vsync{true};
+    int      jitter{0};
+    int      burst{0};
+    int      burstPeriod{0};
+    uint32_t boxWidth{128};
+    uint32_t boxHeight{128};
+    int      speed{8};
+    int      motion{0};
+    int      motionPeriod{0};
+    int      buffers{4};
+    bool     native{false};
+    uint32_t displays{1};
+    int      rotate{0};
+    int      api{ARPCAP_API_VERSION};
+};
+
+struct Rect {
+    uint32_t left{0};
+    uint32_t top{0};
+    uint32_t right{0};
+    uint32_t bottom{0};
+};
+
+enum SlotState {
+    SLOT_FREE = 0,
+    SLOT_QUEUED,
+    SLOT_ACQUIRED,
+};
+
+struct Slot {
+    std::vector<uint8_t> data;
+    SlotState state{SLOT_FREE};
+    uint32_t  width{0};
+    uint32_t  height{0};
+    uint32_t  stride{0};
+    Rect      box;
+    // Regions that changed since the previous frame.
+    std::vector<Rect> damage;
+    int64_t   timestamp{0};
+    uint64_t  frameNumber{0};
+};
+
+class SyntheticDisplay
+{
+  public:
+    SyntheticDisplay(const Config &config, uint32_t width, uint32_t height,
+                     arp_session_callback cb, void *opaque);
+    ~SyntheticDisplay();
+
+    int maxAcquired() const;
+
+    int acquire(ARPFrameBuffer *fb, std::vector<Rect> *damage);
+    void release(int handle);
+    int discard(uint32_t count);
+
+  private:
+    void run();
+    void render(Slot *slot, uint64_t frameNumber);
+    void paint(Slot *slot, const Rect &rect, bool box);
+    uint32_t pixel(uint32_t x, uint32_t y, bool box) const;
+    void addDamage(std::vector<Rect> *damage, const std::vector<Rect> &rects) const;
+
+    Config       mConfig;
+    uint32_t     mWidth;
+    uint32_t     mHeight;
+    uint32_t     mStride;
+    uint32_t     mBpp;
+
+    arp_session_callback mCallback;
+    void                *mOpaque;
+
+    std::vector<Slot> mSlots;
+    std::deque<int>   mQueue;
+    // Damage of the frames discarded since the last acquired one.
+    std::vector<Rect> mDiscardedDamage;
+    Rect              mLastBox;
+    uint64_t          mResizedFrame;
+    int               mAcquired;
+    bool              mStopped;
+
+    std::mutex              mMutex;
+    std::condition_variable mCondition;
+    std::thread             mThread;
+};
+
+Config sConfig;
+
+// Display created through the single-session v1 and v2 API.
+SyntheticDisplay *sDisplay = nullptr;
+arp_callback sCallback = nullptr;
+
+// Handle of the buffer held through the single-buffer v1 API.
+int sHandle = -1;
+
+void v1Callback(void *opaque, uint64_t frameNumber, int64_t timestamp) {
+    (void) opaque;
+
+    if (sCallback != nullptr) {
+        sCallback(frameNumber, timestamp);
+    }
+}
+
+bool isSupportedFormat(int32_t format) {
+    switch (format) {
+    case PIXEL_FORMAT_RGBA_8888:
+    case PIXEL_FORMAT_RGBX_8888:
+    case PIXEL_FORMAT_BGRA_8888:
+    case PIXEL_FORMAT_RGB_565:
+        return true;
+    default:
+        return false;
+    }
+}
+
+uint32_t strideFor(const Config &config, uint32_t width) {
+    return config.stride >= width ? config.stride : (width + 15) & ~15;
+}
+
+uint32_t bytesPerPixel(int32_t format) {
+    return format == PIXEL_FORMAT_RGB_565 ? 2 : 4;
+}
+
+void parseConfig(Config *config) {
+    const char *env = getenv("ARPCAP_SYNTHETIC");
+    if (env == nullptr) {
+        return;
+    }
+
+    char *str = strdup(env);
+    char *lasts = nullptr;
+    for (char *opt = strtok_r(str, ",", &lasts); opt != nullptr; opt = strtok_r(nullptr, ",", &lasts)) {
+        char *value = strchr(opt, '=');
+        if (value == nullptr) {
+            LOGE("Ignoring option '%s'.", opt);
+            continue;
+        }
+        *value++ = '\0';
+
+        if (strcmp(opt, "size") == 0) {
+            sscanf(value, "%ux%u", &config->width, &config->height);
+        } else if (strcmp(opt, "stride") == 0) {
+            config->stride = atoi(value);
+        } else if (strcmp(opt, "format") == 0) {
+            if (strcmp(value, "rgbx") == 0) {
+                config->format = PIXEL_FORMAT_RGBX_8888;
+            } else if (strcmp(value, "bgra") == 0) {
+                config->format = PIXEL_FORMAT_BGRA_8888;
+            } else if (strcmp(value, "rgb565") == 0) {
+                config->format = PIXEL_FORMAT_RGB_565;
+            } else {
+                config->format = PIXEL_FORMAT_RGBA_8888;
+            }
+        } else if (strcmp(opt, "fps") == 0) {
+            config->fps = atoi(value);
+        } else if (strcmp(opt, "vsync") == 0) {
+            config->vsync = atoi(value) != 0;
+        } else if (strcmp(opt, "jitter") == 0) {
+            config->jitter = atoi(value);
+        } else if (strcmp(opt, "burst") == 0) {
+            sscanf(value, "%d/%d", &config->burst, &config->burstPeriod);
+        } else if (strcmp(opt, "box") == 0) {
+            sscanf(value, "%ux%u", &config->boxWidth, &config->boxHeight);
+        } else if (strcmp(opt, "speed") == 0) {
+            config->speed = atoi(value);
+        } else if (strcmp(opt, "motion") == 0) {
+            sscanf(value, "%d/%d", &config->motion, &config->motionPeriod);
+        } else if (strcmp(opt, "buffers") == 0) {
+            config->buffers = atoi(value);
+        } else if (strcmp(opt, "native") == 0) {
+            config->native = atoi(value) != 0;
+        } else if (strcmp(opt, "displays") == 0) {
+            config->displays = atoi(value);
+        } else if (strcmp(opt, "rotate") == 0) {
+            config->rotate = atoi(value);
+        } else if (strcmp(opt, "api") == 0) {
+            config->api = atoi(value);
+        } else {
+            LOGE("Ignoring option '%s'.", opt);
+        }
+    }
+    free(str);
+
+    if (config->fps <= 0) config->fps = 60;
+    if (config->buffers < 2) config->buffers = 2;
+    if (config->burst > config->burstPeriod) config->burst = config->burstPeriod;
+    if (config->motion > config->motionPeriod) config->motion = config->motionPeriod;
+}
+
+int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}  // namespace
+
+SyntheticDisplay::SyntheticDisplay(const Config &config, uint32_t width, uint32_t height,
+                                   arp_session_callback cb, void *opaque) :
+    mConfig(config),
+    mWidth(width),
+    mHeight(height),
+    mStride(strideFor(config, width)),
+    mBpp(bytesPerPixel(config.format)),
+    mCallback(cb),
+    mOpaque(opaque),
+    mSlots(config.buffers),
+    mResizedFrame(1),
+    mAcquired(0),
+    mStopped(false)
+{
+    // Large enough for either orientation.
+    uint32_t size = std::max(width, height);
+    for (auto &slot : mSlots) {
+        slot.data.resize((size_t) strideFor(config, size) * size * mBpp);
+    }
+
+    mThread = std::thread(&SyntheticDisplay::run, this);
+}
+
+SyntheticDisplay::~SyntheticDisplay() {
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mStopped = true;
+        mCondition.notify_all();
+    }
+    mThread.join();
+}
+
+int SyntheticDisplay::maxAcquired() const {
+    // Keep one slot for the producer so it can always make progress.
+    return mSlots.size() - 1;
+}
+
+int SyntheticDisplay::acquire(ARPFrameBuffer *fb, std::vector<Rect> *damage) {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    if (mQueue.empty() || mAcquired == maxAcquired()) {
+        return -1;
+    }
+
+    int handle = mQueue.front();
+    mQueue.pop_front();
+    mAcquired++;
+
+    Slot &slot = mSlots[handle];
+    slot.state = SLOT_ACQUIRED;
+
+    fb->data = slot.data.data();
+    fb->width = slot.width;
+    fb->height = slot.height;
+    fb->format = mConfig.format;
+    fb->stride = slot.stride;
+    fb->timestamp = slot.timestamp;
+    fb->frame_number = slot.frameNumber;
+
+    if (damage != nullptr) {
+        *damage = mDiscardedDamage;
+        addDamage(damage, slot.damage);
+    }
+    mDiscardedDamage.clear();
+
+    return handle;
+}
+
+void SyntheticDisplay::release(int handle) {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    if (handle >= 0 && handle < (int) mSlots.size() && mSlots[handle].state == SLOT_ACQUIRED) {
+        mSlots[handle].state = SLOT_FREE;
+        mAcquired--;
+        mCondition.notify_all();
+    }
+}
+
+int SyntheticDisplay::discard(uint32_t count) {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    uint32_t discarded = 0;
+    while (discarded < count && !mQueue.empty()) {
+        addDamage(&mDiscardedDamage, mSlots[mQueue.front()].damage);
+        mSlots[mQueue.front()].state = SLOT_FREE;
+        mQueue.pop_front();
+        discarded++;
+    }
+    if (discarded > 0) {
+        mCondition.notify_all();
+    }
+
+    return discarded;
+}
+
+void SyntheticDisplay::run() {
+    std::mt19937 rng(0x41525043);
+    std::uniform_int_distribution<int64_t> jitter(0, (int64_t) mConfig.jitter * 1000000);
+
+    const int64_t period = 1000000000LL / mConfig.fps;
+    const int64_t start = now();
+
+    for (uint64_t frameNumber = 1; ; frameNumber++) {
+        int64_t vsync = start + (int64_t) frameNumber * period;
+
+        // Frames inside a burst are held back and delivered together at the
+        // vsync of the last one, as a stalled compositor catching up would.
+        int64_t deliver = vsync;
+        if (mConfig.burst > 1) {
+            uint64_t pos = (frameNumber - 1) % mConfig.burstPeriod;
+            if (pos < (uint64_t) mConfig.burst) {
+                deliver = vsync + (mConfig.burst - 1 - (int64_t) pos) * period;
+            }
+        }
+        deliver += jitter(rng);
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCondition.wait_until(lock,
+                std::chrono::steady_clock::time_point(
+                        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                std::chrono::nanoseconds(deliver))),
+                [this] { return mStopped; });
+
+        // Like a synchronous BufferQueue, block until the consumer frees a slot.
+        int free = -1;
+        mCondition.wait(lock, [this, &free] {
+            for (size_t i = 0; i < mSlots.size() && free < 0; i++) {
+                if (mSlots[i].state == SLOT_FREE) free = i;
+            }
+            return mStopped || free >= 0;
+        });
+        if (mStopped) {
+            break;
+        }
+
+        Slot &slot = mSlots[free];
+        lock.unlock();
+        render(&slot, frameNumber);
+        lock.lock();
+
+        slot.state = SLOT_QUEUED;
+        slot.frameNumber = frameNumber;
+        slot.timestamp = mConfig.vsync ? vsync : now();
+        mQueue.push_back(free);
+        int64_t timestamp = slot.timestamp;
+        lock.unlock();
+
+        if (mCallback != nullptr) {
+            mCallback(mOpaque, frameNumber, timestamp);
+        }
+    }
+}
+
+void SyntheticDisplay::render(Slot *slot, uint64_t frameNumber) {
+    if (mConfig.rotate > 0 && frameNumber > 1 && (frameNumber - 1) % mConfig.rotate == 0) {
+        std::swap(mWidth, mHeight);
+        mStride = strideFor(mConfig, mWidth);
+        mResizedFrame = frameNumber;
+    }
+
+    Rect full;
+    full.right = mWidth;
+    full.bottom = mHeight;
+    if (slot->width != mWidth || slot->height != mHeight) {
+        slot->width = mWidth;
+        slot->height = mHeight;
+        slot->stride = mStride;
+        slot->box = Rect();
+        paint(slot, full, false);
+    }
+
+    uint32_t boxWidth = std::min(mConfig.boxWidth, mWidth);
+    uint32_t boxHeight = std::min(mConfig.boxHeight, mHeight);
+    uint32_t rangeX = mWidth - boxWidth + 1;
+    uint32_t rangeY = mHeight - boxHeight + 1;
+    uint64_t moves = frameNumber;
+    if (mConfig.motionPeriod > 0) {
+        moves = frameNumber / mConfig.motionPeriod * mConfig.motion +
+                std::min<uint64_t>(frameNumber % mConfig.motionPeriod, mConfig.motion);
+    }
+    uint64_t pos = moves * mConfig.speed;
+
+    Rect box;
+    box.left = pos % rangeX;
+    box.top = (pos / rangeX * boxHeight) % rangeY;
+    box.right = box.left + boxWidth;
+    box.bottom = box.top + boxHeight;
+
+    paint(slot, slot->box, false);
+    paint(slot, box, true);
+    slot->box = box;
+
+    slot->damage.clear();
+    if (frameNumber == mResizedFrame) {
+        slot->damage.push_back(full);
+    } else if (memcmp(&box, &mLastBox, sizeof (box)) != 0) {
+        slot->damage.push_back(mLastBox);
+        slot->damage.push_back(box);
+    }
+    mLastBox = box;
+}
+
+void SyntheticDisplay::paint(Slot *slot, const Rect &rect, bool box) {
+    for (uint32_t y = rect.top; y < rect.bottom; y++) {
+        uint8_t *row = slot->data.data() + ((size_t) y * mStride + rect.left) * mBpp;
+        for (uint32_t x = rect.left; x < rect.right; x++) {
+            uint32_t p = pixel(x, y, box);
+            memcpy(row, &p, mBpp);
+            row += mBpp;
+        }
+    }
+}
+
+uint32_t SyntheticDisplay::pixel(uint32_t x, uint32_t y, bool box) const {
+    uint32_t r = box ? 255 : x * 255 / mWidth;
+    uint32_t g = box ? 255 : y * 255 / mHeight;
+    uint32_t b = box ? 0 : 128;
+
+    switch (mConfig.format) {
+    case PIXEL_FORMAT_RGB_565:
+        return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+    case PIXEL_FORMAT_BGRA_8888:
+        return b | (g << 8) | (r << 16) | (0xFFu << 24);
+    default:
+        return r | (g << 8) | (b << 16) | (0xFFu << 24);
+    }
+}
+
+void SyntheticDisplay::addDamage(std::vector<Rect> *damage, const std::vector<Rect> &rects) const {
+    damage->insert(damage->end(), rects.begin(), rects.end());
+
+    // Too many regions, report their bounds instead.
+    if (damage->size() > ARP_MAX_DAMAGE_RECTS) {
+        Rect bounds = damage->front();
+        for (const auto &rect : *damage) {
+            bounds.left = std::min(bounds.left, rect.left);
+            bounds.top = std::min(bounds.top, rect.top);
+            bounds.right = std::max(bounds.right, rect.right);
+            bounds.bottom = std::max(bounds.bottom, rect.bottom);
+        }
+        damage->assign(1, bounds);
+    }
+}
+
+struct ARPSession {
+    ARPSession(const Config &config, uint32_t width, uint32_t height,
+               arp_session_callback cb, void *opaque) :
+        display(config, width, height, cb, opaque)
+    {
+    }
+
+    SyntheticDisplay display;
+};
+
+namespace {
+
+int acquireFrame(SyntheticDisplay *display, ARPFrame *frame) {
+    if (frame->version < 2) {
+        frame->handle = display->acquire(&frame->fb, nullptr);
+        return frame->handle >= 0 ? 0 : -1;
+    }
+
+    std::vector<Rect> damage;
+    frame->handle = display->acquire(&frame->fb, &damage);
+    frame->num_damage_rects = damage.size();
+    for (size_t i = 0; i < damage.size(); i++) {
+        frame->damage_rects[i].left = damage[i].left;
+        frame->damage_rects[i].top = damage[i].top;
+        frame->damage_rects[i].right = damage[i].right;
+        frame->damage_rects[i].bottom = damage[i].bottom;
+    }
+    return frame->handle >= 0 ? 0 : -1;
+}
+
+}  // namespace
+
+void arpcap_init() {
+    parseConfig(&sConfig);
+}
+
+void arpcap_fini() {
+}
+
+int arpcap_get_display_info(ARPDisplayInfo *info) {
+    return arpcap_get_display_info_for(0, info);
+}
+
+int arpcap_set_pixel_format(int32_t format) {
+    if (!isSupportedFormat(format)) {
+        return -1;
+    }
+
+    sConfig.format = format;
+    return 0;
+}
+
+int arpcap_create(
+    uint32_t paddingTop, uint32_t paddingBottom, uint32_t width, uint32_t height, arp_callback cb)
+{
+    (void) paddingTop;
+    (void) paddingBottom;
+
+    if (sDisplay != nullptr) {
+        return -1;
+    }
+
+    if (width == 0 || height == 0 || sConfig.native) {
+        width = sConfig.width;
+        height = sConfig.height;
+    }
+
+    sCallback = cb;
+    sDisplay = new SyntheticDisplay(sConfig, width, height, v1Callback, nullptr);
+    return 0;
+}
+
+void arpcap_destroy() {
+    delete sDisplay;
+    sDisplay = nullptr;
+    sCallback = nullptr;
+    sHandle = -1;
+}
+
+int arpcap_acquire_frame_buffer(ARPFrameBuffer *fb) {
+    if (sDisplay == nullptr || sHandle >= 0) {
+        return -1;
+    }
+
+    sHandle = sDisplay->acquire(fb, nullptr);
+    return sHandle >= 0 ? 0 : -1;
+}
+
+void arpcap_release_frame_buffer() {
+    if (sDisplay != nullptr && sHandle >= 0) {
+        sDisplay->release(sHandle);
+        sHandle = -1;
+    }
+}
+
+int arpcap_get_api_version() {
+    return sConfig.api;
+}
+
+int arpcap_get_max_acquired_frames() {
+    return sDisplay != nullptr ? sDisplay->maxAcquired() : sConfig.buffers - 1;
+}
+
+int arpcap_acquire_frame(ARPFrame *frame) {
+    if (sDisplay == nullptr) {
+        return -1;
+    }
+
+    return acquireFrame(sDisplay, frame);
+}
+
+void arpcap_release_frame(int32_t handle) {
+    if (sDisplay != nullptr) {
+        sDisplay->release(handle);
+    }
+}
+
+int arpcap_discard_frames(uint32_t count) {
+    return sDisplay != nullptr ? sDisplay->discard(count) : 0;
+}
+
+int arpcap_get_display_info_for(uint32_t display, ARPDisplayInfo *info) {
+    if (display >= sConfig.displays) {
+        return -1;
+    }
+
+    info->width = sConfig.width;
+    info->height = sConfig.height;
+    info->orientation = DISPLAY_ORIENTATION_0;
+    return 0;
+}
+
+ARPSession *arpcap_session_create(
+    const ARPSessionParams *params, arp_session_callback cb, void *opaque)
+{
+    if (params->display >= sConfig.displays) {
+        LOGE("No display %u.", params->display);
+        return nullptr;
+    }
+
+    Config config = sConfig;
+    if (params->format != PIXEL_FORMAT_NONE) {
+        if (!isSupportedFormat(params->format)) {
+            return nullptr;
+        }
+        config.format = params->format;
+    }
+
+    uint32_t width = params->width;
+    uint32_t height = params->height;
+    if (width == 0 || height == 0 || config.native) {
+        width = config.width;
+        height = config.height;
+    }
+
+    return new ARPSession(config, width, height, cb, opaque);
+}
+
+void arpcap_session_destroy(ARPSession *session) {
+    delete session;
+}
+
+int arpcap_session_get_max_acquired_frames(ARPSession *session) {
+    return session->display.maxAcquired();
+}
+
+int arpcap_session_acquire_frame(ARPSession *session, ARPFrame *frame) {
+    return acquireFrame(&session->display, frame);
+}
+
+void arpcap_session_release_frame(ARPSession *session, int32_t handle) {
+    session->display.release(handle);
+}
+
+int arpcap_session_discard_frames(ARPSession *session, uint32_t count) {
+    return session->display.discard(count);
+}